@@ -1,6 +1,12 @@
+//Expose the POSIX extensions used below, such as MAP_ANONYMOUS, when compiling in a strict ISO C mode
+#define _DEFAULT_SOURCE
+
 #include "mpc.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 
 #ifdef _WIN32
 
@@ -20,6 +26,18 @@ void add_history(char* unused) {}
 #else
 #include <editline/readline.h>
 #include <editline/history.h>
+#include <sys/resource.h>
+#endif
+
+//Lambdas can only be compiled to native code on x86-64 outside Windows
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_AVAILABLE 1
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#else
+#define JIT_AVAILABLE 0
 #endif
 
 //Parser declerations (for builtin_load)
@@ -35,47 +53,273 @@ mpc_parser_t* Datascript;
 //Forward declarations
 struct val;
 struct env;
+struct code;
+struct memo;
 typedef struct val val;
 typedef struct env env;
+typedef struct code code;
+typedef struct memo memo;
+
+//Slab allocator - vals and envs are carved out of large blocks and recycled through a free list per type
+//Nodes must start with a short tag, it is set to SLAB_FREE while the node is on the free list so the
+//garbage collector can tell released nodes apart when walking the blocks
+#define SLAB_NODES 1024
+#define SLAB_FREE -1
+
+typedef struct slab_pool {
+	char* name;
+	size_t size; //Size of a single node in bytes
+
+	void* free; //Singly linked list of released nodes, the link is stored after the tag in the node itself
+	char* block; //Block nodes are currently being carved from
+	int used; //Number of nodes carved from the current block
+	int blocks; //Number of blocks allocated in total
+	char** block_list; //Every block allocated, in order
+
+	//Counters
+	long allocs;
+	long reuses;
+	long live;
+	long peak;
+} slab_pool;
+
+void* slab_alloc(slab_pool* p) {
+	void* x;
+	p->allocs++;
+
+	if (p->free) {
+		//Reuse most recently released node
+		x = p->free;
+		p->free = *(void**)((char*)x + sizeof(void*));
+		p->reuses++;
+	}
+	else {
+		//Grab a new block when the current one is exhausted
+		if (!p->block || p->used == SLAB_NODES) {
+			p->block = malloc(p->size * SLAB_NODES);
+			p->used = 0;
+			p->blocks++;
+			p->block_list = realloc(p->block_list, sizeof(char*) * p->blocks);
+			p->block_list[p->blocks - 1] = p->block;
+		}
+		x = p->block + p->size * p->used++;
+	}
+
+	p->live++;
+	if (p->live > p->peak) { p->peak = p->live; }
+	return x;
+}
+
+void slab_free(slab_pool* p, void* x) {
+	//Tag the node as released and push it onto the free list
+	*(short*)x = SLAB_FREE;
+	*(void**)((char*)x + sizeof(void*)) = p->free;
+	p->free = x;
+	p->live--;
+}
+
+void slab_print(slab_pool* p) {
+	printf("%-4s allocs: %li reuses: %li live: %li peak: %li blocks: %i (%li bytes)\n",
+		p->name, p->allocs, p->reuses, p->live, p->peak, p->blocks, (long)(p->blocks * SLAB_NODES * p->size));
+}
 
 //Create enum of possible val types
 enum { VAL_ERR, VAL_NUM, VAL_SYM, VAL_STR, VAL_FUN, VAL_SEXPR, VAL_QEXPR };
 
+//Enumeration of error codes, an error keeps the code and its arguments and is only formatted when printed
+enum { ERR_MSG, ERR_FMT, ERR_UNBOUND, ERR_TYPE, ERR_TYPE2, ERR_ARGS, ERR_EMPTY };
+
 //To get a val* we dereference dsbuiltin and call it with a env* and a val*, therefore lbuiltin must be a function pointer that takes an env* and a val* and returns a val*.
 typedef val*(*dsbuiltin)(env*, val*);
 
-//Declare val struct
+//Declare val struct - a type tag followed by the data of that type only
+#define VAL_SMALL_STR 16
+
 struct val {
-	int type;
-	long num;
-	//Error and symbol types have some string data
-	char* err;
-	char* sym;
-	char* str;
-
-	//Functions
-	dsbuiltin dsbuiltin;
-	env* env; //Environment to store arguments
-	val* formals; //
-	val* body; //Function body expression
-
-	//Count of and pointer to address of a list of "val*"
-	int count;
-	val** cell;
+	short type;
+	short flags; //VAL_MARK while being traced by the garbage collector, VAL_ARENA if allocated from the arena
+	int refs; //Number of owners, values are shared and copied only when mutated while shared
+
+	union {
+		//Numbers too large to be stored immediately in the pointer
+		long num;
+
+		//Errors, err holds the message once formatted
+		//what is the function or symbol named in the message, or the message itself for ERR_MSG
+		struct {
+			char* err;
+			char* what;
+			short code;
+			short types[3]; //Types named by a type error
+			int nums[2]; //Argument index or counts
+		};
+
+		//Strings, len characters followed by a null terminator in a buffer of size bytes
+		//Short strings are kept inline in small and str points there, longer ones are on the heap
+		struct {
+			char* str;
+			int len;
+			int size;
+			char small[VAL_SMALL_STR];
+		};
+
+		//Symbols, slot is the position of the binding in a function's frame when resolved or -1
+		//cached is the global value the symbol was last looked up as, valid while version is env_version
+		struct {
+			char* sym;
+			int slot;
+			long version;
+			val* cached;
+		};
+
+		//Functions, a builtin or else a lambda, a partial application of one (VAL_PARTIAL) or a memoized function
+		struct {
+			dsbuiltin dsbuiltin;
+			union {
+				struct {
+					env* env; //Environment to store arguments
+					val* formals; //
+					val* body; //Function body expression
+					code* compiled; //Compiled body shared by every copy of the function, NULL if not compiled
+				};
+
+				//The function applied, and for a partial application the list of the arguments given to it so far
+				//or for a memoized function (VAL_MEMO) the table of its results
+				struct {
+					val* applied;
+					union {
+						val* args;
+						memo* memo;
+					};
+				};
+			};
+		};
+
+		//Count of and pointer to address of a list of "val*", with room allocated for capacity of them
+		//A view shares a slice of the cells of the list owner instead, it has no capacity and is never mutated
+		struct {
+			int count;
+			int capacity;
+			val** cell;
+			val* owner;
+		};
+	};
 };
 
+slab_pool val_pool = { .name = "val", .size = sizeof(val) };
+
+#define VAL_MARK 1
+#define VAL_ARENA 2
+#define VAL_PARTIAL 4
+#define VAL_MEMO 8
+
+#define val_is_partial(v) ((v)->flags & VAL_PARTIAL)
+#define val_is_memo(v) ((v)->flags & VAL_MEMO)
+
+//When the garbage collector is enabled vals are only released by a collection, never by val_del
+int gc_enabled = 0;
+
+//Arena - in arena mode the vals of a top-level form (a REPL line or a file loaded from the command line) are
+//bump allocated from blocks, val_del leaves them be and they are all released in a single pass when the form
+//finishes. Values bound in the global environment are promoted to the slab first so they outlive the form
+typedef struct arena_state {
+	int enabled; //Set by arena_mode, takes effect from the next top-level form
+	int active; //Whether the current form allocates from the arena
+	int depth; //Nesting of top-level forms, as a REPL line may load a file
+
+	int block; //Block nodes are currently being carved from
+	int used; //Number of nodes carved from the current block
+	int blocks;
+	val** block_list;
+
+	//Counters
+	long allocs;
+	long releases;
+	long promotions;
+	long peak;
+} arena_state;
+
+arena_state arena;
+
+val* val_alloc(void) {
+	val* v;
+	if (arena.active) {
+		//Move on to the next block, reusing those left over from previous forms
+		if (arena.used == SLAB_NODES) {
+			arena.block++;
+			arena.used = 0;
+		}
+		if (arena.block == arena.blocks) {
+			arena.blocks++;
+			arena.block_list = realloc(arena.block_list, sizeof(val*) * arena.blocks);
+			arena.block_list[arena.block] = malloc(sizeof(val) * SLAB_NODES);
+		}
+		v = arena.block_list[arena.block] + arena.used++;
+		v->flags = VAL_ARENA;
+		arena.allocs++;
+	}
+	else {
+		v = slab_alloc(&val_pool);
+		v->flags = 0;
+	}
+	v->refs = 1;
+	return v;
+}
+
+//Small numbers are stored in the val* itself, shifted left with the lowest bit set as a tag
+//Slab nodes are always pointer aligned so a real val* never has this bit set
+//Where long is narrower than a pointer every long fits, so the range is the tighter of the two
+#define VAL_IMM_MIN (INTPTR_MIN >> 1 > LONG_MIN ? (long)(INTPTR_MIN >> 1) : LONG_MIN)
+#define VAL_IMM_MAX (INTPTR_MAX >> 1 < LONG_MAX ? (long)(INTPTR_MAX >> 1) : LONG_MAX)
+
+#define val_is_imm(v) (((uintptr_t)(v)) & 1)
+
+int val_type(val* v) {
+	return val_is_imm(v) ? VAL_NUM : v->type;
+}
+
+long val_number(val* v) {
+	return val_is_imm(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
 //Create a pointer to new number type val
 val* val_num(long x) {
-	val* v = malloc(sizeof(val));
+	//Immediate if it fits, no allocation required
+	if (x >= VAL_IMM_MIN && x <= VAL_IMM_MAX) {
+		return (val*)(((uintptr_t)(intptr_t)x << 1) | 1);
+	}
+
+	//Otherwise box it on the heap
+	val* v = val_alloc();
 	v->type = VAL_NUM;
 	v->num = x;
 	return v;
 }
 
-//Error handling function
+//Error with a lazily formatted message, what must outlive the error so is a literal or interned name
+val* val_err_code(short code, char* what, int n0, int n1, short t0, short t1, short t2) {
+	val* v = val_alloc();
+	v->type = VAL_ERR;
+	v->err = NULL;
+	v->what = what;
+	v->code = code;
+	v->nums[0] = n0; v->nums[1] = n1;
+	v->types[0] = t0; v->types[1] = t1; v->types[2] = t2;
+	return v;
+}
+
+//Error with a fixed message
+#define val_err_msg(msg) val_err_code(ERR_MSG, msg, 0, 0, 0, 0, 0)
+
+//Errors raised often enough to be allocated once and shared
+val* err_div_zero;
+
+//Error handling function, formats the message immediately
 val* val_err(char* fmt, ...) {
-	val* v = malloc(sizeof(val));
+	val* v = val_alloc();
 	v->type = VAL_ERR;
+	v->what = NULL;
+	v->code = ERR_FMT;
 
 	//Create a va list and initialize it
 	va_list va;
@@ -96,26 +340,105 @@ val* val_err(char* fmt, ...) {
 	return v;
 }
 
+//Symbol table - every symbol name is stored once so symbols can be compared by pointer
+//Open addressing with linear probing, names are never freed
+//Each name is preceded by a byte of flags, SYM_LOCAL once it has been bound outside the global environment
+#define SYM_LOCAL 1
+
+#define sym_flags(s) ((s)[-1])
+
+typedef struct symtab {
+	char** names;
+	int count;
+	int capacity;
+} symtab;
+
+symtab symbols = { NULL, 0, 0 };
+
+//Hash an address, the low bits are dropped as they are mostly alignment
+#define env_hash_ptr(p) ((unsigned long)(((uintptr_t)(p) >> 3) * 2654435761u))
+
+//Interned symbols the interpreter checks for
+char* sym_amp;
+char* sym_if;
+char* sym_select;
+
+unsigned long sym_hash(char* s) {
+	//FNV-1a
+	unsigned long h = 2166136261u;
+	while (*s) { h = (h ^ (unsigned char)*s++) * 16777619u; }
+	return h;
+}
+
+//Get the canonical copy of a symbol name, adding it if it hasn't been seen before
+char* sym_intern(char* s) {
+	//Keep the table at most half full
+	if (symbols.count * 2 >= symbols.capacity) {
+		int capacity = symbols.capacity ? symbols.capacity * 2 : 256;
+		char** names = calloc(capacity, sizeof(char*));
+		for (int i = 0; i < symbols.capacity; i++) {
+			if (!symbols.names[i]) { continue; }
+			unsigned long j = sym_hash(symbols.names[i]) & (capacity - 1);
+			while (names[j]) { j = (j + 1) & (capacity - 1); }
+			names[j] = symbols.names[i];
+		}
+		free(symbols.names);
+		symbols.names = names;
+		symbols.capacity = capacity;
+	}
+
+	unsigned long i = sym_hash(s) & (symbols.capacity - 1);
+	while (symbols.names[i]) {
+		if (strcmp(symbols.names[i], s) == 0) { return symbols.names[i]; }
+		i = (i + 1) & (symbols.capacity - 1);
+	}
+
+	char* name = malloc(strlen(s) + 2); //strlen + 2 for the flags and because in C all strings are null terminated
+	name[0] = 0;
+	symbols.names[i] = name + 1;
+	strcpy(symbols.names[i], s);
+	symbols.count++;
+	return symbols.names[i];
+}
+
 //Create a pointer to a new symbol type val
 val* val_sym(char* s) {
-	val* v = malloc(sizeof(val));
+	val* v = val_alloc();
 	v->type = VAL_SYM;
-	v->sym = malloc(strlen(s) + 1); //strlen + 1 because in C all strings are null terminated and removing breaks lots of things
-	strcpy(v->sym, s);
+	v->sym = sym_intern(s);
+	v->slot = -1;
+	v->version = 0;
 	return v;
 }
 
+//Set the characters of a string val, storing them inline when they fit
+void val_str_set(val* v, char* s, int len) {
+	v->len = len;
+	if (len < VAL_SMALL_STR) {
+		v->size = VAL_SMALL_STR;
+		v->str = v->small;
+	}
+	else {
+		v->size = len + 1;
+		v->str = malloc(v->size);
+	}
+	memcpy(v->str, s, len);
+	v->str[len] = '\0';
+}
+
+//Release the characters of a string val if they are on the heap
+#define val_str_free(v) if ((v)->str != (v)->small) { free((v)->str); }
+
 //Create a pointer to a new empty string val
 val* val_str(char* s) {
-	val* v = malloc(sizeof(val));
+	val* v = val_alloc();
 	v->type = VAL_STR;
-	v->str = malloc(strlen(s) + 1);
-	strcpy(v->str, s);
+	val_str_set(v, s, strlen(s));
 	return v;
 }
 
 val* val_builtin(dsbuiltin func) {
-	val* v = malloc(sizeof(val));
+	val* v = val_alloc();
 	v->type = VAL_FUN;
 	v->dsbuiltin = func;
 	return v;
@@ -125,7 +448,7 @@ env* env_new(void);
 
 //Create a pointer to a val containing an expression; this being a lambda.
 val* val_lambda(val* formals, val* body) {
-	val* v = malloc(sizeof(val));
+	val* v = val_alloc();
 	v->type = VAL_FUN;
 
 	//Set dsuiltin to null
@@ -137,69 +460,269 @@ val* val_lambda(val* formals, val* body) {
 	//Set formals and body
 	v->formals = formals;
 	v->body = body;
+	v->compiled = NULL;
 	return v;
 }
 
 //Create a pointer to a new empty sexpr type val
 val* val_sexpr(void) {
-	val* v = malloc(sizeof(val));
+	val* v = val_alloc();
 	v->type = VAL_SEXPR;
 	v->count = 0;
+	v->capacity = 0;
 	v->cell = NULL;
+	v->owner = NULL;
 	return v;
 }
 
 //Create a pointer to a new empty qexpression val
 val* val_qexpr(void) {
-	val* v = malloc(sizeof(val));
+	val* v = val_alloc();
 	v->type = VAL_QEXPR;
 	v->count = 0;
+	v->capacity = 0;
 	v->cell = NULL;
+	v->owner = NULL;
 	return v;
 }
 
 void env_del(env* e);
 
-void val_del(val* v) {
+void val_del(val* v);
+
+//Bytecode - a lambda body is compiled into instructions, each an opcode followed by its operands, that vm_run
+//executes on a value stack. Operands k name constants, t and u are positions in the instructions to jump to
+enum {
+	OP_CONST, //Push constant k                                               [k]
+	OP_LOCAL, //Push the formal in slot s of the frame, named by symbol k     [s k]
+	OP_NAME, //Push the value symbol k is bound to                            [k]
+	OP_CALL, //Apply the function n places down the stack to the n - 1 above [n]
+	OP_TAIL_CALL, //As OP_CALL in tail position, returning the call's result  [n]
+	OP_GUARD, //Jump to t unless symbol k is bound to the same builtin as b   [k b t]
+	OP_TEST, //Pop a number and jump to t if it is zero, if it isn't a number push it if an error or else the
+	         //type error argument i of the builtin named by symbol k would raise, and jump to u  [t u k i]
+	OP_JUMP, //Jump to t                                                      [t]
+	OP_EVAL, //Push the result of evaluating expression k with the tree walker [k]
+	OP_RETURN //Return the top of the stack
+};
+
+//Kinds of global a lambda compiled to native code relies on, checked before each call it runs
+enum { JIT_BUILTIN, JIT_NUMBER, JIT_SELF };
+
+typedef struct jit_guard {
+	val* sym;
+	int kind;
+	dsbuiltin func; //Builtin it must be bound to
+	long num; //Number it must be bound to
+} jit_guard;
+
+//Machine code a lambda's body was compiled to, called with an array of its arguments
+typedef struct native {
+	long (*fn)(long*);
+	long size;
+	int nformals;
+	int nguards;
+	jit_guard* guards;
+} native;
+
+struct code {
+	int refs; //Number of functions sharing it
+	int count;
+	int capacity;
+	int* ops;
+	int nconsts;
+	val** consts;
+	int max_stack; //Most values the body has on the stack at once
+
+	long calls; //Calls counted towards compiling to native code
+	native* native;
+	int jit_failed; //Whether the body uses anything native code can't do
+	long bail_frames; //Frame depth and native stack position of the last call that bailed out to the interpreter
+	char* bail_stack;
+};
+
+//A call to a compiled function, run by the same loop as its caller rather than recursing on the C stack
+typedef struct vm_frame {
+	val* owner; //The function call running in the frame, released when it returns
+	code* c; //Where the caller continues
+	int* ip;
+	env* e;
+} vm_frame;
+
+//Value stack and frame stack of the bytecode interpreter, shared by nested runs so the garbage collector can find
+//them. Calls deeper than max_depth frames return an error
+typedef struct vm_state {
+	val** stack;
+	int sp;
+	int capacity;
+
+	vm_frame* frames;
+	long nframes;
+	long frames_capacity;
+	long max_depth;
+} vm_state;
+
+vm_state vm = { NULL, 0, 0, NULL, 0, 0, 1000000 };
+
+//Native stack guard - the tree walker and builtins that evaluate expressions recurse on the C stack, once it
+//has grown native_limit bytes past native_base evaluation returns an error instead of overflowing it
+char* native_base;
+long native_limit;
+
+#define NATIVE_EXHAUSTED(here) (native_base && labs((long)(native_base - (char*)(here))) > native_limit)
+
+//When disabled compiled functions are evaluated by the tree walker instead
+int vm_enabled = 1;
+
+//Native code generation for hot lambdas, off unless enabled with jit_mode
+typedef struct jit_state {
+	int enabled;
+	int verbose; //Print the size and compile time of each function compiled
+	long threshold;
+
+	//Counters
+	long compiled;
+	long failed;
+	long bytes;
+	double time;
+} jit_state;
+
+jit_state jit = { .threshold = 100 };
+
+//Memo tables - the results of a memoized function keyed by its arguments, chained in buckets and kept in a list
+//from the most to the least recently used so the oldest can be evicted once the table is full
+typedef struct memo_entry {
+	unsigned long hash;
+	val* args;
+	val* result;
+	struct memo_entry* chain; //Next entry in the same bucket
+	struct memo_entry* newer;
+	struct memo_entry* older;
+} memo_entry;
+
+struct memo {
+	int refs; //Number of copies of the memoized function sharing it
+	long limit; //Most entries kept, 0 for no limit
+	long count;
+	long capacity; //Number of buckets, a power of two
+	memo_entry** buckets;
+	memo_entry* newest;
+	memo_entry* oldest;
+
+	//Counters
+	long hits;
+	long misses;
+	long evictions;
+};
+
+memo* memo_new(long limit) {
+	memo* m = calloc(1, sizeof(memo));
+	m->refs = 1;
+	m->limit = limit;
+	m->capacity = 16;
+	m->buckets = calloc(m->capacity, sizeof(memo_entry*));
+	return m;
+}
 
+void memo_del(memo* m) {
+	if (--m->refs > 0) { return; }
+	for (memo_entry* x = m->newest; x;) {
+		memo_entry* older = x->older;
+		val_del(x->args);
+		val_del(x->result);
+		free(x);
+		x = older;
+	}
+	free(m->buckets);
+	free(m);
+}
+
+void native_del(native* n, void (*release)(val*));
+
+void code_del(code* c) {
+	if (--c->refs > 0) { return; }
+	if (c->native) { native_del(c->native, val_del); }
+	for (int i = 0; i < c->nconsts; i++) { val_del(c->consts[i]); }
+	free(c->consts);
+	free(c->ops);
+	free(c);
+}
+
+//Release everything a val owns, but not the val itself
+void val_release(val* v) {
 	switch (v->type) {
 
 		case VAL_NUM: break;
 
 		case VAL_FUN: 
-		if (!v->dsbuiltin) {
+		if (val_is_partial(v)) {
+			val_del(v->applied);
+			val_del(v->args);
+		}
+		else if (val_is_memo(v)) {
+			val_del(v->applied);
+			memo_del(v->memo);
+		}
+		else if (!v->dsbuiltin) {
 			env_del(v->env); //Delete the environment
 			val_del(v->formals); //Delete the formals
 			val_del(v->body); //Delete the function body
+			if (v->compiled) { code_del(v->compiled); }
 		}
 		break;
 
 		//For Err or Sym free the string
 		case VAL_ERR: free(v->err); break;
 		
-		case VAL_SYM: free(v->sym); break;
+		//Symbol names are interned and never freed
+		case VAL_SYM: break;
 
-		case VAL_STR: free(v->str); break;
+		case VAL_STR: val_str_free(v); break;
 
-		//If Sexpr then delete all child elements inside
+		//If Sexpr then delete all child elements inside, a view only releases the list it is a slice of
 		case VAL_QEXPR: 
 		case VAL_SEXPR:
+		if (v->owner) {
+			val_del(v->owner);
+			break;
+		}
 		for (int i = 0; i < v->count; i++) {
 			val_del(v->cell[i]);
 		}
 		free(v->cell); //Also free the memory allocated to contain the pointers
 		break;
 	}
+}
+
+void val_del(val* v) {
+
+	//Immediate numbers own no memory
+	if (val_is_imm(v)) { return; }
+
+	//Only free once the last owner lets go, unless the garbage collector or the arena owns freeing
+	if (--v->refs > 0 || gc_enabled || (v->flags & VAL_ARENA)) { return; }
+
+	val_release(v);
 
-	//Free the memory allocated for the val struct itself 
-	free(v);
+	//Return the val struct itself to the slab
+	slab_free(&val_pool, v);
 }
 
-env* env_copy(env* e);
+env* env_ref(env* e);
 
+//Take another reference to a val
+val* val_ref(val* v) {
+	if (!val_is_imm(v)) { v->refs++; }
+	return v;
+}
+
+//Copy a val, children are shared rather than copied since they are copied themselves before being mutated
 val* val_copy(val* v) {
 
-	val* x = malloc(sizeof(val));
+	//Immediate numbers are values, nothing to copy
+	if (val_is_imm(v)) { return v; }
+
+	val* x = val_alloc();
 	x->type = v->type;
 
 	switch (v->type) {
@@ -209,36 +732,64 @@ val* val_copy(val* v) {
 	if (v->dsbuiltin) {
 		x->dsbuiltin = v->dsbuiltin;
 	}
+	else if (val_is_partial(v)) {
+		x->flags |= VAL_PARTIAL;
+		x->dsbuiltin = NULL;
+		x->applied = val_ref(v->applied);
+		x->args = val_ref(v->args);
+	}
+	else if (val_is_memo(v)) {
+		//The table is a cache so copies share it rather than copying it when it is added to
+		x->flags |= VAL_MEMO;
+		x->dsbuiltin = NULL;
+		x->applied = val_ref(v->applied);
+		x->memo = v->memo;
+		x->memo->refs++;
+	}
 	else {
 		x->dsbuiltin = NULL;
-		x->env = env_copy(v->env);
-		x->formals = val_copy(v->formals);
-		x->body = val_copy(v->body);
+		x->env = env_ref(v->env);
+		x->formals = val_ref(v->formals);
+		x->body = val_ref(v->body);
+		x->compiled = v->compiled;
+		if (x->compiled) { x->compiled->refs++; }
 	}
 	break;
 	case VAL_NUM: x->num = v->num; break;
 
-	//Copy error strings using malloc and strcpy
+	//Copy the error code and arguments, and the message using malloc and strcpy if already formatted
 	case VAL_ERR:
-		x->err = malloc(strlen(v->err) + 1);
-		strcpy(x->err, v->err); break;
+		x->err = NULL;
+		x->what = v->what;
+		x->code = v->code;
+		memcpy(x->types, v->types, sizeof(x->types));
+		memcpy(x->nums, v->nums, sizeof(x->nums));
+		if (v->err) {
+			x->err = malloc(strlen(v->err) + 1);
+			strcpy(x->err, v->err);
+		}
+		break;
 
-	//Copy symbols using malloc and strcpy
+	//Symbols share the interned name
 	case VAL_SYM:
-		x->sym = malloc(strlen(v->sym) + 1);
-		strcpy(x->sym, v->sym); break;
+		x->sym = v->sym;
+		x->slot = v->slot;
+		x->version = v->version;
+		x->cached = v->cached;
+		break;
 
-	//Copy strings using malloc and strcpy
-	case VAL_STR: x->str = malloc(strlen(v->str) + 1);
-		strcpy(x->str, v->str); break;
+	//Copy strings, short ones stay inline
+	case VAL_STR: val_str_set(x, v->str, v->len); break;
 
 	//Copy lists by copying each sub-expression
 	case VAL_QEXPR:
 	case VAL_SEXPR:
 		x->count = v->count;
+		x->capacity = v->count;
+		x->owner = NULL;
 		x->cell = malloc(sizeof(val*) * x->count);
 		for (int i = 0; i < x->count; i++) {
-			x->cell[i] = val_copy(v->cell[i]);
+			x->cell[i] = val_ref(v->cell[i]);
 		}
 		break;
 	}
@@ -246,28 +797,110 @@ val* val_copy(val* v) {
 	return x;
 }
 
+//Check if a val is a list view
+#define val_is_view(v) ((val_type(v) == VAL_SEXPR || val_type(v) == VAL_QEXPR) && (v)->owner)
+
+//Get a val that is safe to mutate, copying it if it is shared with anyone else or a view
+val* val_own(val* v) {
+	if (val_is_imm(v) || (v->refs == 1 && !val_is_view(v))) { return v; }
+	val* x = val_copy(v);
+	val_del(v);
+	return x;
+}
+
+//Start evaluating a top-level form, allocating from the arena if arena mode is enabled
+void arena_begin(void) {
+	if (arena.depth++ == 0 && arena.enabled && !gc_enabled) {
+		arena.active = 1;
+	}
+}
+
+//Finish a top-level form, releasing everything allocated from the arena while evaluating it in one pass
+void arena_end(void) {
+	if (--arena.depth > 0 || !arena.active) { return; }
+
+	arena.active = 0;
+	long used = (long)arena.block * SLAB_NODES + arena.used;
+	if (used > arena.peak) { arena.peak = used; }
+
+	for (int b = 0; b <= arena.block && b < arena.blocks; b++) {
+		int n = b == arena.block ? arena.used : SLAB_NODES;
+		for (int i = 0; i < n; i++) { val_release(arena.block_list[b] + i); }
+	}
+
+	arena.releases += used;
+	arena.block = 0;
+	arena.used = 0;
+}
+
+//Make room for at least n cells in a list, growing geometrically so appending is amortized constant
+#define VAL_MIN_CAPACITY 4
+
+void val_reserve(val* v, int n) {
+	if (n <= v->capacity) { return; }
+
+	int capacity = v->capacity ? v->capacity : VAL_MIN_CAPACITY;
+	while (capacity < n) { capacity *= 2; }
+
+	v->cell = realloc(v->cell, sizeof(val*) * capacity);
+	v->capacity = capacity;
+}
+
 val* val_add(val* v, val* x) {
-	v->count++;
-	v->cell = realloc(v->cell, sizeof(val*) * v->count);
-	v->cell[v->count - 1] = x;
+	v = val_own(v);
+	val_reserve(v, v->count + 1);
+	v->cell[v->count++] = x;
 	return v;
 }
 
 //Child function of Join
 val* val_join(val* x, val* y) {
 	
-	//For each cell in 'y' add it to 'x'
-	for (int i = 0; i < y->count; i++) 
-	{
-		x = val_add(x, y->cell[i]);
+	//Grow 'x' once for all of the cells of 'y'
+	x = val_own(x);
+	val_reserve(x, x->count + y->count);
+
+	//If 'y' is shared its cells must be referenced rather than moved
+	if (y->refs > 1 || y->owner) {
+		for (int i = 0; i < y->count; i++) {
+			x->cell[x->count++] = val_ref(y->cell[i]);
+		}
+		val_del(y);
+		return x;
+	}
+
+	//Move each cell in 'y' to 'x'
+	if (y->count) {
+		memcpy(&x->cell[x->count], y->cell, sizeof(val*) * y->count);
+		x->count += y->count;
 	}
 	
-	//Delete the empty 'y' and return 'x'
+	//Delete the empty 'y' and return 'x', an arena val is left empty to be released with the rest of the arena
 	free(y->cell);
-	free(y);
+	if (y->flags & VAL_ARENA) {
+		y->count = 0;
+		y->capacity = 0;
+		y->cell = NULL;
+	}
+	else {
+		slab_free(&val_pool, y);
+	}
 	return x;
 }
 
+//Create a view of count cells of a list starting at offset, sharing them rather than copying
+val* val_view(val* l, int offset, int count) {
+	val* v = val_alloc();
+	v->type = l->type;
+	v->count = count;
+	v->capacity = 0;
+	v->cell = l->cell + offset;
+
+	//Views of views share the original list
+	v->owner = val_ref(l->owner ? l->owner : l);
+	return v;
+}
+
 val* val_pop(val* v, int i) {
 	//Find the item at position i
 	val* x = v->cell[i];
@@ -278,14 +911,24 @@ val* val_pop(val* v, int i) {
 	//Decrease the count of items in the list
 	v->count--;
 
-	//Reallocate the memory used
-	v->cell = realloc(v->cell, sizeof(val*) * v->count);
+	//Give back memory once the list has shrunk to a quarter of its capacity
+	if (v->capacity > VAL_MIN_CAPACITY && v->count < v->capacity / 4) {
+		v->capacity /= 2;
+		v->cell = realloc(v->cell, sizeof(val*) * v->capacity);
+	}
 	
 	//Return pointer to list with popped val
 	return x;
 }
 
 val* val_take(val* v, int i) {
+	//If shared there is no need to pop, just keep the item
+	if (v->refs > 1 || v->owner) {
+		val* x = val_ref(v->cell[i]);
+		val_del(v);
+		return x;
+	}
+
 	val* x = val_pop(v, i);
 	val_del(v);
 	return x;
@@ -310,8 +953,8 @@ void val_expr_print(val* v, char open, char close) {
 
 void val_str_print(val* v) {
 	//Make a copy of the string
-	char* escaped = malloc(strlen(v->str) + 1);
-	strcpy(escaped, v->str);
+	char* escaped = malloc(v->len + 1);
+	memcpy(escaped, v->str, v->len + 1);
 	//Pass it through the escape function
 	escaped = mpcf_escape(escaped);
 	//Print it between " characters
@@ -320,20 +963,34 @@ void val_str_print(val* v) {
 	free(escaped);
 }
 
+char* val_err_str(val* v);
+
 //Print a val - A container for numbers, sexpressions, symbols and errors *MAKE IT SO IT PROVIDES POSITIONAL EXPLANATIONS FOR ERRORS USING THE AST*
 void val_print(val* v) {
-	switch (v->type) {
+	switch (val_type(v)) {
 	case VAL_FUN:
 		if (v->dsbuiltin) {
 			printf("<builtin>");
 		}
+		else if (val_is_partial(v)) {
+			//Shown as the lambda of the formals still to be bound
+			val* formals = v->applied->formals;
+			int bound = v->args->count;
+			val* rest = val_view(formals, bound, formals->count - bound);
+			printf("(lambda "); val_print(rest);
+			putchar(' '); val_print(v->applied->body); putchar(')');
+			val_del(rest);
+		}
+		else if (val_is_memo(v)) {
+			printf("(memo "); val_print(v->applied); putchar(')');
+		}
 		else {
 			printf("(lambda "); val_print(v->formals);
 			putchar(' '); val_print(v->body); putchar(')');
 		}
 		break;
-	case VAL_NUM:   printf("%li", v->num); break;
-	case VAL_ERR:   printf("error: %s", v->err); break;
+	case VAL_NUM:   printf("%li", val_number(v)); break;
+	case VAL_ERR:   printf("error: %s", val_err_str(v)); break;
 	case VAL_SYM:   printf("%s", v->sym); break;
 	case VAL_STR:   val_str_print(v); break;
 	case VAL_SEXPR: val_expr_print(v, '(', ')'); break;
@@ -344,30 +1001,49 @@ void val_print(val* v) {
 //Print a val followed by a newline
 void val_println(val* v) { val_print(v); putchar('\n'); }
 
+int env_equal(env* x, env* y);
+unsigned long env_hash_bindings(env* e);
+
 //Body function for checking values are equal
 int val_equal(val* x, val* y) {
 
 	//Different types are always unequal
-	if (x->type != y->type) { return 0; }
+	if (val_type(x) != val_type(y)) { return 0; }
 
 	//Compare based upon type
-	switch (x->type) {
+	switch (val_type(x)) {
 		//Compare number value
-	case VAL_NUM: return (x->num == y->num);
+	case VAL_NUM: return (val_number(x) == val_number(y));
 
 		//Compare string values
-	case VAL_ERR: return (strcmp(x->err, y->err) == 0);
-	case VAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-	case VAL_STR: return (strcmp(x->str, y->str) == 0);
+	case VAL_ERR:
+		//Errors with the same code and arguments have the same message, without formatting either
+		if (x->code == y->code && x->code != ERR_FMT) {
+			return strcmp(x->what, y->what) == 0
+				&& memcmp(x->nums, y->nums, sizeof(x->nums)) == 0
+				&& memcmp(x->types, y->types, sizeof(x->types)) == 0;
+		}
+		return (strcmp(val_err_str(x), val_err_str(y)) == 0);
+	case VAL_SYM: return (x->sym == y->sym);
+	case VAL_STR: return x->len == y->len && memcmp(x->str, y->str, x->len) == 0;
 
 		//If builtin compare, otherwise compare formals and body
 	case VAL_FUN:
 		if (x->dsbuiltin || y->dsbuiltin) {
 			return x->dsbuiltin == y->dsbuiltin;
 		}
+		else if (val_is_memo(x) || val_is_memo(y)) {
+			return val_is_memo(x) && val_is_memo(y) && x->memo == y->memo;
+		}
+		else if (val_is_partial(x) || val_is_partial(y)) {
+			return val_is_partial(x) && val_is_partial(y)
+				&& val_equal(x->applied, y->applied)
+				&& val_equal(x->args, y->args);
+		}
 		else {
 			return val_equal(x->formals, y->formals)
-				&& val_equal(x->body, y->body);
+				&& val_equal(x->body, y->body)
+				&& env_equal(x->env, y->env);
 		}
 
 		//If list compare every individual element
@@ -385,6 +1061,34 @@ int val_equal(val* x, val* y) {
 	return 0;
 }
 
+//Structural hash, values val_equal considers equal hash the same
+unsigned long val_hash(val* v) {
+	unsigned long h = val_type(v) * 2654435761u;
+	switch (val_type(v)) {
+	case VAL_NUM: return h ^ ((unsigned long)val_number(v) * 11400714819323198485u);
+	case VAL_SYM: return h ^ env_hash_ptr(v->sym);
+	case VAL_STR:
+		//FNV-1a
+		for (int i = 0; i < v->len; i++) { h = (h ^ (unsigned char)v->str[i]) * 16777619u; }
+		return h;
+
+	//Errors compare by message, which is left unformatted here
+	case VAL_ERR: return h;
+
+	case VAL_FUN:
+		if (v->dsbuiltin) { return h ^ env_hash_ptr(v->dsbuiltin); }
+		if (val_is_memo(v)) { return h ^ env_hash_ptr((char*)v->memo); }
+		if (val_is_partial(v)) { return h ^ (val_hash(v->applied) * 31 + val_hash(v->args)); }
+		return h ^ ((val_hash(v->formals) * 31 + val_hash(v->body)) * 31 + env_hash_bindings(v->env));
+
+	case VAL_QEXPR:
+	case VAL_SEXPR:
+		for (int i = 0; i < v->count; i++) { h = h * 31 + val_hash(v->cell[i]); }
+		return h;
+	}
+	return h;
+}
+
 //Convert ENUMS to string names
 char* type_name(int t) {
 	switch (t) {
@@ -399,120 +1103,649 @@ char* type_name(int t) {
 	}
 }
 
+//Format the message of an error the first time it is needed, the message is a cache so may be set on a shared error
+char* val_err_str(val* v) {
+	if (v->err) { return v->err; }
+
+	char buffer[512];
+	switch (v->code) {
+	case ERR_MSG: return v->what;
+	case ERR_UNBOUND:
+		snprintf(buffer, sizeof(buffer), "unbound Symbol '%s'", v->what); break;
+	case ERR_TYPE:
+		snprintf(buffer, sizeof(buffer), "function '%s' passed incorrect type for argument %i; got %s, expected %s.",
+			v->what, v->nums[0], type_name(v->types[0]), type_name(v->types[1])); break;
+	case ERR_TYPE2:
+		snprintf(buffer, sizeof(buffer), "function '%s' passed incorrect type for argument %i; got %s, expected %s or %s.",
+			v->what, v->nums[0], type_name(v->types[0]), type_name(v->types[1]), type_name(v->types[2])); break;
+	case ERR_ARGS:
+		snprintf(buffer, sizeof(buffer), "function '%s' passed incorrect number of arguments; got %i, expected %i.",
+			v->what, v->nums[0], v->nums[1]); break;
+	case ERR_EMPTY:
+		snprintf(buffer, sizeof(buffer), "function '%s' passed {} for argument %i.", v->what, v->nums[0]); break;
+	default: return "";
+	}
+
+	v->err = malloc(strlen(buffer) + 1);
+	strcpy(v->err, buffer);
+	return v->err;
+}
+
+//Environments keep their bindings in insertion order, once they grow past ENV_SMALL bindings
+//an open addressing index from symbol to binding position is kept alongside so lookups stay constant
+#define ENV_SMALL 8
+
+#define ENV_GLOBAL 2
+
 struct env {
-	env* par;
+	short flags; //Slab tag, VAL_MARK while being traced by the garbage collector, ENV_GLOBAL for the global environment
+	int refs; //Number of functions sharing it, copied before being bound into
 	int count;
-	char** syms;
+	int capacity;
+	env* par;
+	char** syms; //Interned symbol names
 	val** vals;
+
+	//Hash index of binding positions + 1, 0 for an empty slot. NULL while the environment is small
+	int* index;
+	int index_capacity;
 };
 
+slab_pool env_pool = { .name = "env", .size = sizeof(env) };
+
+//Version of the global environment, changed whenever a global is bound or a name is first bound anywhere else
+//Lookups of names only ever bound globally are cached in the symbol looked up until it changes
+long env_version = 1;
+
 //Create new environment
 env* env_new(void) {
-	env* e = malloc(sizeof(env));
+	env* e = slab_alloc(&env_pool);
+	e->flags = 0;
+	e->refs = 1;
 	e->par = NULL;
 	e->count = 0;
+	e->capacity = 0;
 	e->syms = NULL;
 	e->vals = NULL;
+	e->index = NULL;
+	e->index_capacity = 0;
 	return e;
 }
 
-//Delete an environment
+//Delete an environment once the last function sharing it lets go
 void env_del(env* e) {
+	if (--e->refs > 0) { return; }
 	for (int i = 0; i < e->count; i++) {
-		free(e->syms[i]);
 		val_del(e->vals[i]);
 	}
 	free(e->syms);
 	free(e->vals);
-	free(e);
+	free(e->index);
+	slab_free(&env_pool, e);
+}
+
+//Symbol names are interned so the address itself is hashed
+unsigned long env_hash(char* sym) {
+	return env_hash_ptr(sym);
+}
+
+//Rebuild the hash index with room for at least twice the bindings
+void env_reindex(env* e) {
+	int capacity = 16;
+	while (capacity < e->count * 2) { capacity *= 2; }
+
+	free(e->index);
+	e->index = calloc(capacity, sizeof(int));
+	e->index_capacity = capacity;
+
+	for (int i = 0; i < e->count; i++) {
+		unsigned long j = env_hash(e->syms[i]) & (capacity - 1);
+		while (e->index[j]) { j = (j + 1) & (capacity - 1); }
+		e->index[j] = i + 1;
+	}
+}
+
+//Find the position of a binding in this environment only, -1 if it isn't bound
+int env_find(env* e, char* sym) {
+	//Small environments are scanned directly
+	if (!e->index) {
+		for (int i = 0; i < e->count; i++) {
+			if (e->syms[i] == sym) { return i; }
+		}
+		return -1;
+	}
+
+	unsigned long j = env_hash(sym) & (e->index_capacity - 1);
+	while (e->index[j]) {
+		if (e->syms[e->index[j] - 1] == sym) { return e->index[j] - 1; }
+		j = (j + 1) & (e->index_capacity - 1);
+	}
+	return -1;
+}
+
+//Whether two environments bind the same symbols to equal values in the same order, as the variables captured by
+//closures of the same lambda are
+int env_equal(env* x, env* y) {
+	if (x == y) { return 1; }
+	if (x->count != y->count) { return 0; }
+	for (int i = 0; i < x->count; i++) {
+		if (x->syms[i] != y->syms[i] || !val_equal(x->vals[i], y->vals[i])) { return 0; }
+	}
+	return 1;
+}
+
+//Hash of the bindings of an environment, consistent with env_equal
+unsigned long env_hash_bindings(env* e) {
+	unsigned long h = 0;
+	for (int i = 0; i < e->count; i++) { h = h * 31 + (env_hash_ptr(e->syms[i]) ^ val_hash(e->vals[i])); }
+	return h;
 }
 
 env* env_copy(env* e) {
-	env* n = malloc(sizeof(env));
+	env* n = slab_alloc(&env_pool);
+	n->flags = 0;
+	n->refs = 1;
 	n->par = e->par;
 	n->count = e->count;
+	n->capacity = e->count;
 	n->syms = malloc(sizeof(char*) * n->count);
 	n->vals = malloc(sizeof(val*) * n->count);
+	n->index = NULL;
+	n->index_capacity = 0;
 	for (int i = 0; i < e->count; i++) {
-		n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-		strcpy(n->syms[i], e->syms[i]);
-		n->vals[i] = val_copy(e->vals[i]);
+		n->syms[i] = e->syms[i];
+		n->vals[i] = val_ref(e->vals[i]);
 	}
+	if (e->index) { env_reindex(n); }
 	return n;
 }
 
+//Take another reference to an environment, copies of a function share it
+env* env_ref(env* e) {
+	e->refs++;
+	return e;
+}
+
 //Get a value from an environment
 val* env_get(env* e, val* k) {
 
-	//Iterate over all items in environment
-	for (int i = 0; i < e->count; i++) {
-		//Check if the stored string matches the symbol string
-		//If it does, return a copy of the value
-		if (strcmp(e->syms[i], k->sym) == 0) {
-			return val_copy(e->vals[i]);
+	//Walk up the environments until one binds the symbol
+	while (e) {
+		//If it does, return a reference to the value
+		int i = env_find(e, k->sym);
+		if (i >= 0) {
+			return val_ref(e->vals[i]);
 		}
+		e = e->par;
 	}
 
-	//If no symbol check in parent otherwise error
-	if (e->par) {
-		return env_get(e->par, k);
+	//If no environment binds it then error
+	return val_err_code(ERR_UNBOUND, k->sym, 0, 0, 0, 0, 0);
+}
+
+//Get a value through the inline cache of the symbol naming it. Nothing can shadow the global binding of a name
+//that has never been bound elsewhere, so those are cached until the global environment changes
+val* env_lookup(env* e, val* k) {
+	if (k->version == env_version) { return val_ref(k->cached); }
+
+	val* x = env_get(e, k);
+	if (!(sym_flags(k->sym) & SYM_LOCAL) && val_type(x) != VAL_ERR) {
+		k->version = env_version;
+		k->cached = x;
 	}
-	else {
-		return val_err("unbound Symbol '%s'", k->sym);
+	return x;
+}
+
+//Bind a val to a symbol in an environment, the val is shared with the caller
+//Move a value out of the arena so it can outlive the current form, takes a reference and returns one
+//A heap value may have been given arena values while unshared, those are replaced by promoted copies in place
+//as that doesn't change what the value means
+val* val_promote(val* v) {
+	if (val_is_imm(v)) { return v; }
+
+	if (v->flags & VAL_ARENA) {
+		//Copy to the slab, the children are promoted below
+		int active = arena.active;
+		arena.active = 0;
+		val* x = val_copy(v);
+		arena.active = active;
+		val_del(v);
+		v = x;
+		arena.promotions++;
+	}
+
+	switch (v->type) {
+	case VAL_FUN:
+		if (val_is_partial(v)) {
+			v->applied = val_promote(v->applied);
+			v->args = val_promote(v->args);
+		}
+		else if (val_is_memo(v)) {
+			v->applied = val_promote(v->applied);
+		}
+		else if (!v->dsbuiltin) {
+			v->formals = val_promote(v->formals);
+			v->body = val_promote(v->body);
+			for (int i = 0; i < v->env->count; i++) { v->env->vals[i] = val_promote(v->env->vals[i]); }
+			if (v->compiled) {
+				for (int i = 0; i < v->compiled->nconsts; i++) { v->compiled->consts[i] = val_promote(v->compiled->consts[i]); }
+			}
+		}
+		break;
+	case VAL_QEXPR:
+	case VAL_SEXPR:
+		if (v->owner) {
+			val* owner = val_promote(val_ref(v->owner));
+			v->cell = owner->cell + (v->cell - v->owner->cell);
+			val_del(v->owner);
+			v->owner = owner;
+			break;
+		}
+		for (int i = 0; i < v->count; i++) { v->cell[i] = val_promote(v->cell[i]); }
+		break;
 	}
+	return v;
 }
 
-//Copy environment val and symbols to new memory address
+void env_append(env* e, char* sym, val* v);
+void env_bind(env* e, char* sym, val* v);
+
 void env_put(env* e, val* k, val* v) {
-	//Iterate over all items in environment
-	//This is to see if variable already exists
-	for (int i = 0; i < e->count; i++) {
+	//Global bindings outlive the form being evaluated
+	v = (e->flags & ENV_GLOBAL) ? val_promote(val_ref(v)) : val_ref(v);
+	env_bind(e, k->sym, v);
+}
 
-		//If variable is found delete item at that position
-		//And replace with variable supplied by user
-		if (strcmp(e->syms[i], k->sym) == 0) {
-			val_del(e->vals[i]);
-			e->vals[i] = val_copy(v);
-			return;
-		}
+//Bind a val to a symbol, taking the reference to v
+void env_bind(env* e, char* sym, val* v) {
+	if (e->flags & ENV_GLOBAL) { env_version++; }
+
+	//See if variable already exists
+	int i = env_find(e, sym);
+
+	//If variable is found delete item at that position
+	//And replace with variable supplied by user
+	if (i >= 0) {
+		val_del(e->vals[i]);
+		e->vals[i] = v;
+		return;
+	}
+
+	env_append(e, sym, v);
+}
+
+//Add a new binding, taking the reference to v
+void env_append(env* e, char* sym, val* v) {
+	//The first binding of a name outside the global environment stops its global value being cached
+	if (!(e->flags & ENV_GLOBAL) && !(sym_flags(sym) & SYM_LOCAL)) {
+		sym_flags(sym) |= SYM_LOCAL;
+		env_version++;
 	}
 
-	//If no existing entry found allocate space for new entry
+	//Make space for new entry
+	if (e->count == e->capacity) {
+		e->capacity = e->capacity ? e->capacity * 2 : 4;
+		e->vals = realloc(e->vals, sizeof(val*) * e->capacity);
+		e->syms = realloc(e->syms, sizeof(char*) * e->capacity);
+	}
 	e->count++;
-	e->vals = realloc(e->vals, sizeof(val*) * e->count);
-	e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
-	//Copy contents of val and symbol string into new location
-	e->vals[e->count - 1] = val_copy(v);
-	e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-	strcpy(e->syms[e->count - 1], k->sym);
+	//Share the val and the interned symbol name
+	e->vals[e->count - 1] = v;
+	e->syms[e->count - 1] = sym;
+
+	//Index the new binding, rebuilding once the index is half full
+	if (e->count > ENV_SMALL) {
+		if (e->count * 2 > e->index_capacity) {
+			env_reindex(e);
+		}
+		else {
+			unsigned long j = env_hash(sym) & (e->index_capacity - 1);
+			while (e->index[j]) { j = (j + 1) & (e->index_capacity - 1); }
+			e->index[j] = e->count;
+		}
+	}
 }
 
 void env_def(env* e, val* k, val* v) {
 	//Iterate till e has no parent
 	while (e->par) { e = e->par; }
+
 	//Put value in e
 	env_put(e, k, v);
 }
 
-//C Macros
-#define ASSERT(args, cond, fmt, ...) \
-  if (!(cond)) { val* err = val_err(fmt, ##__VA_ARGS__); val_del(args); return err; }
+//Give a callee's frame the bindings of its caller's frame it doesn't shadow, and the caller's parent, so lookups
+//from the callee find the same values once the caller's frame is released after a tail call
+void env_merge(env* e, env* caller) {
+	for (int i = 0; i < caller->count; i++) {
+		if (env_find(e, caller->syms[i]) < 0) {
+			env_append(e, caller->syms[i], val_ref(caller->vals[i]));
+		}
+	}
+	e->par = caller->par;
+}
 
-#define ASSERT_TYPE(func, args, index, expect) \
-  ASSERT(args, args->cell[index]->type == expect, "function '%s' passed incorrect type for argument %i; got %s, expected %s.", func, index, type_name(args->cell[index]->type), type_name(expect))
+//Garbage collector - opt-in mark and sweep over the slabs. While enabled val_del only drops the
+//reference count and nodes are reclaimed once they can't be reached from the roots; the global
+//environment and the vals pushed on the root stack by active call frames and the REPL
+typedef struct gc_state {
+	env* global;
+
+	//Root stack
+	val** roots;
+	int nroots;
+	int capacity;
+
+	//Tuning - collect once live nodes reach threshold, then grow it to growth% of the survivors
+	long threshold;
+	long min_threshold;
+	int growth;
+
+	//Statistics
+	long collections;
+	long freed;
+	long last_freed;
+	long last_live;
+	double time; //Total seconds spent collecting
+	double last_time;
+} gc_state;
+
+gc_state gc = { .threshold = 100000, .min_threshold = 100000, .growth = 200 };
+
+void gc_push(val* v) {
+	if (gc.nroots == gc.capacity) {
+		gc.capacity = gc.capacity ? gc.capacity * 2 : 64;
+		gc.roots = realloc(gc.roots, sizeof(val*) * gc.capacity);
+	}
+	gc.roots[gc.nroots++] = v;
+}
 
-#define ASSERT_TYPE_DOUBLE(func, args, index, expect, expect2) \
-  ASSERT(args, args->cell[index]->type == expect ||  args->cell[index]->type == expect2, "function '%s' passed incorrect type for argument %i; got %s, expected %s or %s.", func, index, type_name(args->cell[index]->type), type_name(expect), type_name(expect2))
+void gc_pop(int n) {
+	gc.nroots -= n;
+}
 
+void gc_mark_env(env* e);
 
-#define ASSERT_NUM(func, args, num) \
-  ASSERT(args, args->count == num, "function '%s' passed incorrect number of arguments; got %i, expected %i.", func, args->count, num)
+void gc_mark(val* v) {
+	//Immediates aren't allocated, released nodes may be left on the root stack
+	if (!v || val_is_imm(v) || v->type == SLAB_FREE || (v->flags & VAL_MARK)) { return; }
+	v->flags |= VAL_MARK;
 
-#define ASSERT_NOT_EMPTY(func, args, index) \
-  ASSERT(args, args->cell[index]->count != 0, "function '%s' passed {} for argument %i.", func, index);
+	switch (v->type) {
+	case VAL_FUN:
+		if (val_is_partial(v)) {
+			gc_mark(v->applied);
+			gc_mark(v->args);
+		}
+		else if (val_is_memo(v)) {
+			gc_mark(v->applied);
+			for (memo_entry* x = v->memo->newest; x; x = x->older) {
+				gc_mark(x->args);
+				gc_mark(x->result);
+			}
+		}
+		else if (!v->dsbuiltin) {
+			gc_mark_env(v->env);
+			gc_mark(v->formals);
+			gc_mark(v->body);
+			if (v->compiled) {
+				for (int i = 0; i < v->compiled->nconsts; i++) { gc_mark(v->compiled->consts[i]); }
+				if (v->compiled->native) {
+					for (int i = 0; i < v->compiled->native->nguards; i++) { gc_mark(v->compiled->native->guards[i].sym); }
+				}
+			}
+		}
+		break;
+	case VAL_QEXPR:
+	case VAL_SEXPR:
+		if (v->owner) { gc_mark(v->owner); break; }
+		for (int i = 0; i < v->count; i++) { gc_mark(v->cell[i]); }
+		break;
+	}
+}
+
+void gc_mark_env(env* e) {
+	if (e->flags == SLAB_FREE || (e->flags & VAL_MARK)) { return; }
+	e->flags |= VAL_MARK;
+	for (int i = 0; i < e->count; i++) { gc_mark(e->vals[i]); }
+}
+
+//Drop the reference a garbage node holds, unmarked children are garbage themselves and swept separately
+void gc_release(val* v) {
+	if (!val_is_imm(v) && (v->flags & VAL_MARK)) { v->refs--; }
+}
+
+void gc_free_val(val* v) {
+	switch (v->type) {
+	case VAL_FUN:
+		if (val_is_partial(v)) {
+			gc_release(v->applied);
+			gc_release(v->args);
+		}
+		else if (val_is_memo(v)) {
+			gc_release(v->applied);
+			if (--v->memo->refs == 0) {
+				for (memo_entry* x = v->memo->newest; x;) {
+					memo_entry* older = x->older;
+					gc_release(x->args);
+					gc_release(x->result);
+					free(x);
+					x = older;
+				}
+				free(v->memo->buckets);
+				free(v->memo);
+			}
+		}
+
+		//The environment is garbage too unless another copy of the function is still reachable
+		else if (!v->dsbuiltin) {
+			if (v->env->flags & VAL_MARK) { v->env->refs--; }
+			gc_release(v->formals);
+			gc_release(v->body);
+			if (v->compiled && --v->compiled->refs == 0) {
+				if (v->compiled->native) { native_del(v->compiled->native, gc_release); }
+				for (int i = 0; i < v->compiled->nconsts; i++) { gc_release(v->compiled->consts[i]); }
+				free(v->compiled->consts);
+				free(v->compiled->ops);
+				free(v->compiled);
+			}
+		}
+		break;
+	case VAL_ERR: free(v->err); break;
+	case VAL_STR: val_str_free(v); break;
+	case VAL_QEXPR:
+	case VAL_SEXPR:
+		if (v->owner) { gc_release(v->owner); break; }
+		for (int i = 0; i < v->count; i++) { gc_release(v->cell[i]); }
+		free(v->cell);
+		break;
+	}
+	slab_free(&val_pool, v);
+}
+
+void gc_free_env(env* e) {
+	for (int i = 0; i < e->count; i++) {
+		gc_release(e->vals[i]);
+	}
+	free(e->syms);
+	free(e->vals);
+	free(e->index);
+	slab_free(&env_pool, e);
+}
+
+//Call func on every node carved from the pool, including released ones
+void gc_walk(slab_pool* p, void (*func)(void*)) {
+	for (int b = 0; b < p->blocks; b++) {
+		int n = p->block_list[b] == p->block ? p->used : SLAB_NODES;
+		for (int i = 0; i < n; i++) { func(p->block_list[b] + p->size * i); }
+	}
+}
+
+void gc_sweep_val(void* x) {
+	val* v = x;
+	if (v->type != SLAB_FREE && !(v->flags & VAL_MARK)) { gc_free_val(v); }
+}
+
+void gc_sweep_env(void* x) {
+	env* e = x;
+	if (e->flags != SLAB_FREE && !(e->flags & VAL_MARK)) { gc_free_env(e); }
+}
+
+//Marks are cleared in a separate pass as sweeping relies on them to adjust reference counts
+void gc_unmark_val(void* x) {
+	val* v = x;
+	if (v->type != SLAB_FREE) { v->flags &= ~VAL_MARK; }
+}
+
+void gc_unmark_env(void* x) {
+	env* e = x;
+	if (e->flags != SLAB_FREE) { e->flags &= ~VAL_MARK; }
+}
+
+long gc_collect(void) {
+	clock_t start = clock();
+	long before = val_pool.live + env_pool.live;
+
+	//Mark everything reachable from the roots
+	if (gc.global) { gc_mark_env(gc.global); }
+	for (int i = 0; i < gc.nroots; i++) { gc_mark(gc.roots[i]); }
+	for (int i = 0; i < vm.sp; i++) { gc_mark(vm.stack[i]); }
+	for (long i = 0; i < vm.nframes; i++) { gc_mark(vm.frames[i].owner); }
+
+	//Free the rest and reset the marks
+	gc_walk(&val_pool, gc_sweep_val);
+	gc_walk(&env_pool, gc_sweep_env);
+	gc_walk(&val_pool, gc_unmark_val);
+	gc_walk(&env_pool, gc_unmark_env);
+
+	//Update statistics
+	gc.last_live = val_pool.live + env_pool.live;
+	gc.last_freed = before - gc.last_live;
+	gc.freed += gc.last_freed;
+	gc.collections++;
+	gc.last_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+	gc.time += gc.last_time;
+
+	//Grow the heap relative to what survived
+	gc.threshold = gc.last_live * gc.growth / 100;
+	if (gc.threshold < gc.min_threshold) { gc.threshold = gc.min_threshold; }
+
+	return gc.last_freed;
+}
+
+//Collect if enabled and the heap has grown past the threshold, only call where every temporary is rooted
+void gc_maybe(void) {
+	if (gc_enabled && val_pool.live + env_pool.live >= gc.threshold) {
+		gc_collect();
+	}
+}
+
+//C Macros
+#define ASSERT(args, cond, fmt, ...) \
+  if (!(cond)) { val* err = val_err(fmt, ##__VA_ARGS__); val_del(args); return err; }
+
+//Like ASSERT but raising an error with a code, formatted only if it is printed
+#define ASSERT_CODE(args, cond, code, func, n0, n1, t0, t1, t2) \
+  if (!(cond)) { val* err = val_err_code(code, func, n0, n1, t0, t1, t2); val_del(args); return err; }
+
+#define ASSERT_TYPE(func, args, index, expect) \
+  ASSERT_CODE(args, val_type(args->cell[index]) == expect, ERR_TYPE, func, index, 0, val_type(args->cell[index]), expect, 0)
+
+#define ASSERT_TYPE_DOUBLE(func, args, index, expect, expect2) \
+  ASSERT_CODE(args, val_type(args->cell[index]) == expect ||  val_type(args->cell[index]) == expect2, ERR_TYPE2, func, index, 0, val_type(args->cell[index]), expect, expect2)
+
+
+#define ASSERT_NUM(func, args, num) \
+  ASSERT_CODE(args, args->count == num, ERR_ARGS, func, args->count, num, 0, 0, 0)
+
+#define ASSERT_NOT_EMPTY(func, args, index) \
+  ASSERT_CODE(args, (val_type(args->cell[index]) != VAL_QEXPR && val_type(args->cell[index]) != VAL_SEXPR) || args->cell[index]->count != 0, ERR_EMPTY, func, index, 0, 0, 0, 0);
 
 val* val_eval(env* e, val* v);
+code* vm_compile(val* body);
+val* vm_run(env* e, code* c);
+val* builtin_select(env* e, val* a);
+
+//Tail calls - a call in tail position returns VAL_TAIL after recording what is left to evaluate in tail instead
+//of evaluating it, and val_eval carries on with it in a loop so chains of tail calls run in constant stack space
+typedef struct tail_state {
+	env* env; //Environment to evaluate in
+	val* expr; //Expression to evaluate, or NULL to run the compiled body of owner
+	val* owner; //Function call whose frame env is, to be released once evaluation leaves it, or NULL
+} tail_state;
+
+tail_state tail;
+
+//Only the address of val_tail is used
+val val_tail;
+#define VAL_TAIL (&val_tail)
+
+val* val_tail_eval(env* e, val* x, val* owner) {
+	tail.env = e;
+	tail.expr = x;
+	tail.owner = owner;
+	return VAL_TAIL;
+}
+
+val* val_eval_pending(void);
+
+//Resolve symbols in a function body that name one of its formals to the slot that formal is bound to in the
+//function's frame. A slot is only a hint checked against the frame when used, so shared or later reused
+//expressions resolved for a different function still evaluate correctly
+void val_resolve(val* v, val* formals) {
+	switch (val_type(v)) {
+	case VAL_SYM:
+		//Formals are bound in order, skipping '&' and duplicates which rebind an earlier slot
+		for (int i = 0, slot = 0; i < formals->count; i++) {
+			char* sym = formals->cell[i]->sym;
+			if (sym == sym_amp) { continue; }
+
+			int first = 1;
+			for (int j = 0; j < i; j++) {
+				if (formals->cell[j]->sym == sym) { first = 0; break; }
+			}
+			if (!first) { continue; }
+
+			if (sym == v->sym) { v->slot = slot; return; }
+			slot++;
+		}
+		v->slot = -1;
+		break;
+	case VAL_SEXPR:
+	case VAL_QEXPR:
+		for (int i = 0; i < v->count; i++) { val_resolve(v->cell[i], formals); }
+		break;
+	}
+}
+
+//Capture the bindings of the call frames a function is created in that its body uses, so it still sees them
+//once those calls return. Formals and names with a global binding, such as builtins, are left to be looked up
+//when the function runs, so a frame that happens to reuse one of them doesn't hide it
+void val_capture(val* f, env* e, val* v) {
+	switch (val_type(v)) {
+	case VAL_SYM: {
+		if (v->slot >= 0 || env_find(f->env, v->sym) >= 0) { return; }
+
+		env* g = e;
+		while (g->par && !(g->flags & ENV_GLOBAL)) { g = g->par; }
+		if (env_find(g, v->sym) >= 0) { return; }
+
+		for (; e && !(e->flags & ENV_GLOBAL); e = e->par) {
+			int i = env_find(e, v->sym);
+			if (i >= 0) {
+				env_append(f->env, v->sym, val_ref(e->vals[i]));
+				return;
+			}
+		}
+		break;
+	}
+	case VAL_SEXPR:
+	case VAL_QEXPR:
+		for (int i = 0; i < v->count; i++) { val_capture(f, e, v->cell[i]); }
+		break;
+	}
+}
 
 //Lambda function, used for defining expressions
 val* builtin_lambda(env* e, val* a) {
@@ -523,7 +1756,7 @@ val* builtin_lambda(env* e, val* a) {
 
 	//Check first qexpression contains only symbols
 	for (int i = 0; i < a->cell[0]->count; i++) {
-		ASSERT(a, (a->cell[0]->cell[i]->type == VAL_SYM), "cannot define non-symbol. Got %s, Expected %s.", type_name(a->cell[0]->cell[i]->type), type_name(VAL_SYM));
+		ASSERT(a, (val_type(a->cell[0]->cell[i]) == VAL_SYM), "cannot define non-symbol. Got %s, Expected %s.", type_name(val_type(a->cell[0]->cell[i])), type_name(VAL_SYM));
 	}
 
 	//Pop first two arguments and pass them to val_lambda
@@ -531,7 +1764,13 @@ val* builtin_lambda(env* e, val* a) {
 	val* body = val_pop(a, 0);
 	val_del(a);
 
-	return val_lambda(formals, body);
+	//Address references to the formals by frame slot
+	val_resolve(body, formals);
+
+	val* f = val_lambda(formals, body);
+	f->compiled = vm_compile(body);
+	val_capture(f, e, body);
+	return f;
 }
 
 val* builtin_fun(env* e, val* a)
@@ -541,20 +1780,23 @@ val* builtin_fun(env* e, val* a)
 	ASSERT_TYPE("if", a, 1, VAL_QEXPR);
 	ASSERT_TYPE("if", a, 2, VAL_QEXPR);
 
-	//Mark both expressions as evaluateable
+	//Take the chosen expression, the branches may be shared with a function body
 	val* x;
-	a->cell[1]->type = VAL_SEXPR;
-	a->cell[2]->type = VAL_SEXPR;
-
-	if (a->cell[0]->num) {
-		//If condition is true evaluate first expression
-		x = val_eval(e, val_pop(a, 1));
+	if (val_number(a->cell[0])) {
+		//If condition is true take first expression
+		x = val_own(val_pop(a, 1));
 	}
 	else {
-		//Otherwise evaluate second expression
-		x = val_eval(e, val_pop(a, 2));
+		//Otherwise take second expression
+		x = val_own(val_pop(a, 2));
 	}
 
+	//Mark it as evaluateable and evaluate it
+	x->type = VAL_SEXPR;
+	gc_push(a);
+	x = val_eval(e, x);
+	gc_pop(1);
+
 	//Delete argument list and return
 	val_del(a);
 	return x;
@@ -562,6 +1804,7 @@ val* builtin_fun(env* e, val* a)
 
 //List function - Converts input S-Expression into a Q-Expression and returns it
 val* builtin_list(env* e, val* a) {
+	a = val_own(a);
 	a->type = VAL_QEXPR;
 	return a;
 }
@@ -580,10 +1823,10 @@ val* builtin_body(env* e, val* a) {
 	//Otherwise take first argument
 	val* v = val_take(a, 0);
 
-	//Delete head and tail and then return
-	val_del(val_pop(v, 0));
-	val_del(val_pop(v, v->count-1));
-	return v;
+	//View everything but the head and tail
+	val* x = val_view(v, v->count > 1 ? 1 : 0, v->count > 1 ? v->count - 2 : 0);
+	val_del(v);
+	return x;
 }
 
 //Head function - Returns first item in list
@@ -600,9 +1843,10 @@ val* builtin_head(env* e, val* a) {
 	//Otherwise take first argument
 	val* v = val_take(a, 0);
 
-	//Delete all elements that are not head and return
-	while (v->count > 1) { val_del(val_pop(v, 1)); }
-	return v;
+	//View only the head
+	val* x = val_view(v, 0, 1);
+	val_del(v);
+	return x;
 }
 
 //Tail function - returns all but first item of function
@@ -620,9 +1864,10 @@ val* builtin_tail(env* e, val* a) {
 	//Take first argument
 	val* v = val_take(a, 0);
 
-	//Delete first element and return
-	val_del(val_pop(v, 0));
-	return v;
+	//View everything after the first element
+	val* x = val_view(v, 1, v->count - 1);
+	val_del(v);
+	return x;
 }
 
 //Eval function - Take a Q-Expression and evaluate it as an S-Expression to get the result
@@ -630,9 +1875,9 @@ val* builtin_eval(env* e, val* a) {
 	ASSERT_NUM("eval", a, 1);
 	ASSERT_TYPE("eval", a, 0, VAL_QEXPR);
 
-	val* x = val_take(a, 0);
+	val* x = val_own(val_take(a, 0));
 	x->type = VAL_SEXPR;
-	return val_eval(e, x);
+	return val_tail_eval(e, x, NULL);
 }
 
 //Pop function - Removes a selected item by index from a list
@@ -647,12 +1892,12 @@ val* builtin_pop(env* e, val* a) {
 	//{} passed to function
 	ASSERT_NOT_EMPTY("pop", a, 0);
 
-	val* x = val_pop(a, 0); //List
+	val* x = val_own(val_pop(a, 0)); //List
 	val* y = val_pop(a, 0); //Pop index
 
-	if (y->num <= x->count)
+	if (val_number(y) <= x->count)
 	{
-		val_pop(x, y->num);
+		val_del(val_pop(x, val_number(y)));
 	}
 
 	val_del(a);
@@ -669,7 +1914,7 @@ val* builtin_len(env* e, val* a) {
 
 	val* x = val_pop(a, 0); //Supplied argument to find length of
 
-	switch (x->type) 
+	switch (val_type(x)) 
 	{
 		case VAL_QEXPR: case VAL_SEXPR: 
 		{
@@ -678,13 +1923,13 @@ val* builtin_len(env* e, val* a) {
 		}
 		case VAL_STR:
 		{
-			x = val_num(strlen(x->str));
+			x = val_num(x->len);
 			break;
 		}
 		case VAL_NUM:
 		{
-			char buffer[sizeof(x->num) * 8 + 1]; 
-			x = val_num(strlen(_ultoa(x->num, buffer, 10)));
+			char buffer[sizeof(long) * 8 + 1]; 
+			x = val_num(snprintf(buffer, sizeof(buffer), "%li", val_number(x)));
 			break;
 		}
 	}
@@ -708,13 +1953,20 @@ val* builtin_fetch(env* e, val* a) {
 	val* x = val_pop(a, 0); //List
 	val* y = val_pop(a, 0); //Fetched index
 
-	if (y->num <= x->count)
+	long i = val_number(y);
+	val_del(y);
+
+	if (i >= 0 && i < x->count)
 	{
-		x = val_take(x,y->num);
+		//Share the item rather than popping it out of the list
+		val* v = val_ref(x->cell[i]);
+		val_del(x);
+		x = v;
 	}
 	else 
 	{
-		x = val_err("invalid index");
+		val_del(x);
+		x = val_err_msg("invalid index");
 	}
 
 	val_del(a);
@@ -750,7 +2002,7 @@ val* builtin_typeof(env* e, val* a) {
 	//Otherwise take first argument
 	val* v = val_take(a, 0);
 	
-	return val_num(v->type);
+	return val_num(val_type(v));
 }
 
 //Head function - Returns first item in list
@@ -764,47 +2016,94 @@ val* builtin_typename(env* e, val* a) {
 	//Otherwise take first argument
 	val* v = val_take(a, 0);
 
-	return val_str(type_name(v->num));
+	return val_str(type_name(val_number(v)));
 }
 
 
 //Builtin operands, (+,-,*,/)
-val* builtin_op(env* e, val* a, char* op) {
+//Arithmetic operators other than '+', which also joins strings, and the names errors report them by
+enum { ARITH_SUB, ARITH_MUL, ARITH_DIV };
+
+char* arith_names[] = { "-", "*", "/" };
+
+//Divide by a non-zero number. Dividing by -1 negates with wraparound, as the smallest long has no positive
+//counterpart and dividing it would trap
+long val_div(long x, long y) {
+	return y == -1 ? (long)(0 - (unsigned long)x) : x / y;
+}
+
+val* builtin_op(env* e, val* a, int op) {
 
 	//Ensure all arguments are numbers
 	for (int i = 0; i < a->count; i++) {
-		ASSERT_TYPE(op, a, i, VAL_NUM);
+		ASSERT_TYPE(arith_names[op], a, i, VAL_NUM);
 	}
 
-	//Pop the first element
-	val* x = val_pop(a, 0);
+	//Fold the arguments into the first, each operator in its own loop
+	long num = val_number(a->cell[0]);
+	switch (op) {
+	case ARITH_SUB:
+		//If no other arguments then perform negation
+		if (a->count == 1) { num = -num; }
+		for (int i = 1; i < a->count; i++) { num -= val_number(a->cell[i]); }
+		break;
+
+	case ARITH_MUL:
+		for (int i = 1; i < a->count; i++) { num *= val_number(a->cell[i]); }
+		break;
 
-	//If no arguments and sub then perform negation
-	if ((strcmp(op, "-") == 0) && a->count == 0) {
-		x->num = -x->num;
+	case ARITH_DIV:
+		for (int i = 1; i < a->count; i++) {
+			long y = val_number(a->cell[i]);
+			if (y == 0) {
+				val_del(a);
+				return val_ref(err_div_zero);
+			}
+			num = val_div(num, y);
+		}
+		break;
 	}
 
-	//While there are still elements remaining
-	while (a->count > 0) {
+	val_del(a);
+	return val_num(num);
+}
 
-		//Pop the next element
-		val* y = val_pop(a, 0);
+//Append n characters to a string, the string must not be shared
+void val_str_append(val* v, char* s, int n) {
+	if (v->len + n + 1 > v->size) {
+		int size = v->size * 2;
+		while (size < v->len + n + 1) { size *= 2; }
 
-		if (strcmp(op, "+") == 0) { if (x->type == VAL_NUM) { x->num += y->num; } else if (x->type == VAL_STR) { x->str = (strcat(x->str,y->str)); }; }
-		if (strcmp(op, "-") == 0) { x->num -= y->num; }
-		if (strcmp(op, "*") == 0) { x->num *= y->num; }
-		if (strcmp(op, "/") == 0) {
-			if (y->num == 0) {
-				val_del(x);
-				val_del(y);
-				x = val_err("Division By Zero.");
-				break;
-			}
-			x->num /= y->num;
+		//Inline characters move to the heap once they outgrow the value
+		if (v->str == v->small) {
+			v->str = memcpy(malloc(size), v->small, v->len + 1);
 		}
-		val_del(y);
+		else {
+			v->str = realloc(v->str, size);
+		}
+		v->size = size;
 	}
-	val_del(a);
+
+	memcpy(v->str + v->len, s, n);
+	v->len += n;
+	v->str[v->len] = '\0';
+}
+
+//Number formed by all the digit characters in a string, ignoring everything else
+long val_str_digits(val* v) {
+	char* digits = malloc(v->len + 1);
+	int j = 0;
+
+	for (int i = 0; i < v->len; i++) {
+		if (v->str[i] >= '0' && v->str[i] <= '9') {
+			digits[j++] = v->str[i];
+		}
+	}
+	digits[j] = '\0';
+
+	//Convert string to long
+	long x = strtol(digits, NULL, 10);
+	free(digits);
 	return x;
 }
 
@@ -819,95 +2118,72 @@ val* builtin_add(env* e, val* a) {
 	//Pop the first element
 	val* x = val_pop(a, 0);
 
-	//While there are still elements remaining
-	while (a->count > 0) {
-
-		//Pop the next element
-		val* y = val_pop(a, 0);
-
-		switch (x->type)
-		{
-			case VAL_STR:
-			{
-				char * ystr;
+	//Strings have every other argument appended, growing the buffer geometrically so joining many fragments is linear
+	if (val_type(x) == VAL_STR) {
+		x = val_own(x);
 
-				if (y->type == VAL_NUM) { char buffer[sizeof(y->num) * 8 + 1]; ystr = _ultoa(y->num, buffer, 10); } else { ystr = y->str; }
-
-				char* s = strcat(x->str, ystr);
-				x->type = VAL_STR;
-				x->str = malloc(strlen(s) + 1);
-				x->str = strcpy(x->str, s);
-				break;
+		for (int i = 0; i < a->count; i++) {
+			val* y = a->cell[i];
+			if (val_type(y) == VAL_NUM) {
+				char buffer[sizeof(long) * 8 + 1];
+				val_str_append(x, buffer, snprintf(buffer, sizeof(buffer), "%li", val_number(y)));
 			}
-
-			case VAL_NUM:
-			{
-				long ynum;
-
-				if (y->type == VAL_STR) 
-				{ 
-					char* modstring = y->str;
-
-					//Remove all non number characters from the string
-					int j = 0;
-
-					for (int i = 0; modstring[i]; i++) {
-						if (modstring[i] >= '0' && modstring[i] <= '9') {
-							modstring[j] = modstring[i];
-							j++;
-						}
-					}
-
-					modstring[j] = '\0';
-
-					//Convert string to long
-					char *ptr; 
-					ynum = strtol(modstring,&ptr, 10); 
-				}
-				else 
-				{
-					ynum = y->num;
-				}
-
-				x->num += ynum;
+			else {
+				val_str_append(x, y->str, y->len);
 			}
 		}
 
-		val_del(y);
+		val_del(a);
+		return x;
+	}
+
+	//Numbers are summed, strings count as the number formed by their digits
+	long num = val_number(x);
+	val_del(x);
+
+	for (int i = 0; i < a->count; i++) {
+		val* y = a->cell[i];
+		num += val_type(y) == VAL_STR ? val_str_digits(y) : val_number(y);
 	}
+
 	val_del(a);
-	return x;
+	return val_num(num);
 }
 
 val* builtin_sub(env* e, val* a) {
-	return builtin_op(e, a, "-");
+	return builtin_op(e, a, ARITH_SUB);
 }
 
 val* builtin_mul(env* e, val* a) {
-	return builtin_op(e, a, "*");
+	return builtin_op(e, a, ARITH_MUL);
 }
 
 val* builtin_div(env* e, val* a) {
-	return builtin_op(e, a, "/");
+	return builtin_op(e, a, ARITH_DIV);
 }
 
-val* builtin_var(env* e, val* a, char* func) {
+//Whether builtin_var defines globally or in the current environment, and the names errors report them by
+enum { VAR_DEF, VAR_PUT };
+
+char* var_names[] = { "def", "=" };
+
+val* builtin_var(env* e, val* a, int scope) {
+	char* func = var_names[scope];
 	ASSERT_TYPE(func, a, 0, VAL_QEXPR);
 
 	val* syms = a->cell[0];
 	for (int i = 0; i < syms->count; i++) {
-		ASSERT(a, (syms->cell[i]->type == VAL_SYM), "function '%s' cannot define non-symbol; got %s, expected %s.", func, type_name(syms->cell[i]->type), type_name(VAL_SYM));
+		ASSERT(a, (val_type(syms->cell[i]) == VAL_SYM), "function '%s' cannot define non-symbol; got %s, expected %s.", func, type_name(val_type(syms->cell[i])), type_name(VAL_SYM));
 	}
 
 	ASSERT(a, (syms->count == a->count - 1), "function '%s' passed too many arguments for symbols; got %i, expected %i.", func, syms->count, a->count - 1);
 
 	for (int i = 0; i < syms->count; i++) {
-		//If 'var' define in globally. If 'putvar' define in locally
-		if (strcmp(func, "def") == 0) {
+		//If 'def' define in globally. If '=' define in locally
+		if (scope == VAR_DEF) {
 			env_def(e, syms->cell[i], a->cell[i + 1]);
 		}
-
-		if (strcmp(func, "=") == 0) {
+		else {
 			env_put(e, syms->cell[i], a->cell[i + 1]);
 		}
 	}
@@ -917,31 +2193,37 @@ val* builtin_var(env* e, val* a, char* func) {
 }
 
 val* builtin_def(env* e, val* a) {
-	return builtin_var(e, a, "def");
+	return builtin_var(e, a, VAR_DEF);
 }
 
 val* builtin_put(env* e, val* a) {
-	return builtin_var(e, a, "=");
+	return builtin_var(e, a, VAR_PUT);
 }
 
-//Conditonal controller
-val* builtin_ord(env* e, val* a, char* op) {
-	ASSERT_NUM(op, a, 2);
-	ASSERT_TYPE(op, a, 0, VAL_NUM);
-	ASSERT_TYPE(op, a, 1, VAL_NUM);
+//Ordering and equality operators, and the names errors report them by
+enum { ORD_GT, ORD_LT, ORD_GE, ORD_LE };
 
-	int r;
-	if (strcmp(op, ">") == 0) {
-		r = (a->cell[0]->num > a->cell[1]->num);
-	}
-	if (strcmp(op, "<") == 0) {
-		r = (a->cell[0]->num < a->cell[1]->num);
-	}
-	if (strcmp(op, ">=") == 0) {
-		r = (a->cell[0]->num >= a->cell[1]->num);
-	}
-	if (strcmp(op, "<=") == 0) {
-		r = (a->cell[0]->num <= a->cell[1]->num);
+char* ord_names[] = { ">", "<", ">=", "<=" };
+
+enum { CMP_EQ, CMP_NE };
+
+char* cmp_names[] = { "==", "!=" };
+
+//Conditonal controller
+val* builtin_ord(env* e, val* a, int op) {
+	ASSERT_NUM(ord_names[op], a, 2);
+	ASSERT_TYPE(ord_names[op], a, 0, VAL_NUM);
+	ASSERT_TYPE(ord_names[op], a, 1, VAL_NUM);
+
+	long x = val_number(a->cell[0]);
+	long y = val_number(a->cell[1]);
+
+	int r = 0;
+	switch (op) {
+	case ORD_GT: r = x > y; break;
+	case ORD_LT: r = x < y; break;
+	case ORD_GE: r = x >= y; break;
+	case ORD_LE: r = x <= y; break;
 	}
 	val_del(a);
 	return val_num(r);
@@ -949,40 +2231,63 @@ val* builtin_ord(env* e, val* a, char* op) {
 
 //Conditionals
 val* builtin_greater(env* e, val* a) {
-	return builtin_ord(e, a, ">");
+	return builtin_ord(e, a, ORD_GT);
 }
 
 val* builtin_less(env* e, val* a) {
-	return builtin_ord(e, a, "<");
+	return builtin_ord(e, a, ORD_LT);
 }
 
 val* builtin_greaterorequal(env* e, val* a) {
-	return builtin_ord(e, a, ">=");
+	return builtin_ord(e, a, ORD_GE);
 }
 
 val* builtin_lessorequal(env* e, val* a) {
-	return builtin_ord(e, a, "<=");
+	return builtin_ord(e, a, ORD_LE);
 }
 
-val* builtin_compare(env* e, val* a, char* op) {
-	ASSERT_NUM(op, a, 2);
-	int r;
-	if (strcmp(op, "==") == 0) {
-		r = val_equal(a->cell[0], a->cell[1]);
-	}
-	if (strcmp(op, "!=") == 0) {
-		r = !val_equal(a->cell[0], a->cell[1]);
-	}
+val* builtin_compare(env* e, val* a, int op) {
+	ASSERT_NUM(cmp_names[op], a, 2);
+	int r = val_equal(a->cell[0], a->cell[1]);
+	if (op == CMP_NE) { r = !r; }
 	val_del(a);
 	return val_num(r);
 }
 
 val* builtin_equal(env* e, val* a) {
-	return builtin_compare(e, a, "==");
+	return builtin_compare(e, a, CMP_EQ);
 }
 
 val* builtin_notequal(env* e, val* a) {
-	return builtin_compare(e, a, "!=");
+	return builtin_compare(e, a, CMP_NE);
+}
+
+//Apply + - * / < > == or != to one or two numbers directly, without building a list of arguments to pass
+//Returns NULL if f is any other function or an argument isn't a number, leaving the call to the builtin
+val* val_arith(val* f, val** args, int n) {
+	if (val_type(f) != VAL_FUN || !f->dsbuiltin || n < 1 || n > 2) { return NULL; }
+	if (val_type(args[0]) != VAL_NUM || (n == 2 && val_type(args[1]) != VAL_NUM)) { return NULL; }
+
+	dsbuiltin op = f->dsbuiltin;
+	long x = val_number(args[0]);
+
+	//A single argument is negated by '-' and left as it is by the other arithmetic operators
+	if (n == 1) {
+		if (op == builtin_sub) { return val_num(-x); }
+		if (op == builtin_add || op == builtin_mul || op == builtin_div) { return val_num(x); }
+		return NULL;
+	}
+
+	long y = val_number(args[1]);
+	if (op == builtin_add) { return val_num(x + y); }
+	if (op == builtin_sub) { return val_num(x - y); }
+	if (op == builtin_mul) { return val_num(x * y); }
+	if (op == builtin_div) { return y == 0 ? val_ref(err_div_zero) : val_num(val_div(x, y)); }
+	if (op == builtin_less) { return val_num(x < y); }
+	if (op == builtin_greater) { return val_num(x > y); }
+	if (op == builtin_equal) { return val_num(x == y); }
+	if (op == builtin_notequal) { return val_num(x != y); }
+	return NULL;
 }
 
 val* builtin_if(env* e, val* a) {
@@ -991,23 +2296,54 @@ val* builtin_if(env* e, val* a) {
 	ASSERT_TYPE("if", a, 1, VAL_QEXPR);
 	ASSERT_TYPE("if", a, 2, VAL_QEXPR);
 
-	//Mark both expressions as evaluateable
+	//Take the chosen expression, the branches may be shared with a function body
 	val* x;
-	a->cell[1]->type = VAL_SEXPR;
-	a->cell[2]->type = VAL_SEXPR;
-
-	if (a->cell[0]->num) {
-		//If condition is true evaluate first expression
-		x = val_eval(e, val_pop(a, 1));
+	if (val_number(a->cell[0])) {
+		//If condition is true take first expression
+		x = val_own(val_pop(a, 1));
 	}
 	else {
-		//Otherwise evaluate second expression
-		x = val_eval(e, val_pop(a, 2));
+		//Otherwise take second expression
+		x = val_own(val_pop(a, 2));
 	}
 
-	//Delete argument list and return
+	//Mark it as evaluateable and leave it to be evaluated in tail position
+	x->type = VAL_SEXPR;
 	val_del(a);
-	return x;
+	return val_tail_eval(e, x, NULL);
+}
+
+//Select - Takes clauses {condition expression} and evaluates the expression of the first whose condition is true
+val* builtin_select(env* e, val* a) {
+	for (int i = 0; i < a->count; i++) {
+		ASSERT_TYPE("select", a, i, VAL_QEXPR);
+		ASSERT(a, a->cell[i]->count == 2, "function 'select' passed invalid clause %i; got %i elements, expected 2.", i, a->cell[i]->count);
+	}
+
+	gc_push(a);
+	for (int i = 0; i < a->count; i++) {
+		val* c = val_eval(e, val_ref(a->cell[i]->cell[0]));
+		if (val_type(c) != VAL_NUM) {
+			gc_pop(1);
+			val_del(a);
+			if (val_type(c) == VAL_ERR) { return c; }
+			val* err = val_err_code(ERR_TYPE, "select", i, 0, val_type(c), VAL_NUM, 0);
+			val_del(c);
+			return err;
+		}
+
+		//Evaluate the chosen expression in tail position
+		if (val_number(c)) {
+			val* x = val_ref(a->cell[i]->cell[1]);
+			gc_pop(1);
+			val_del(a);
+			return val_tail_eval(e, x, NULL);
+		}
+	}
+	gc_pop(1);
+
+	val_del(a);
+	return val_err_msg("function 'select' found no true condition.");
 }
 
 val* builtin_while(env* e, val* a) {
@@ -1017,14 +2353,16 @@ val* builtin_while(env* e, val* a) {
 
 	//Mark both expressions as evaluateable
 	val* x;
-	a->cell[1]->type = VAL_SEXPR;
-
-	x = val_pop(a, 1);
+	x = val_own(val_pop(a, 1));
+	x->type = VAL_SEXPR;
 
-	while (a->cell[0]->num) {
-		//If condition is true evaluate first expression
-		val_print(val_eval(e, x));
+	gc_push(a);
+	gc_push(x);
+	while (val_number(a->cell[0])) {
+		//If condition is true evaluate first expression, evaluation consumes so pass a reference
+		val_print(val_eval(e, val_ref(x)));
 	}
+	gc_pop(2);
 
 	//Delete argument list and return
 	val_del(a);
@@ -1037,17 +2375,20 @@ val* builtin_loop(env* e, val* a) {
 	ASSERT_TYPE("loop", a, 1, VAL_QEXPR);
 
 	//Mark expression as evaluateable
-	val* x = val_err("Something went wrong!!");
-	a->cell[1]->type = VAL_SEXPR;
-
-	val* y = val_pop(a, 1);
-
-	for (int i = 0; i < a->cell[0]->num; i++) {
-		//If condition is true evaluate first expression
-		x = val_eval(e, y);
+	val* x = val_err_msg("Something went wrong!!");
+	val* y = val_own(val_pop(a, 1));
+	y->type = VAL_SEXPR;
+
+	gc_push(a);
+	gc_push(y);
+	for (int i = 0; i < val_number(a->cell[0]); i++) {
+		//If condition is true evaluate first expression, evaluation consumes so pass a reference
+		x = val_eval(e, val_ref(y));
 	}
+	gc_pop(2);
 
 	//Delete argument list and return
+	val_del(y);
 	val_del(a);
 	return x;
 }
@@ -1065,38 +2406,45 @@ val* builtin_range(env* e, val* a) {
 	ASSERT_NOT_EMPTY("range", a, 0);
 
 	//Otherwise take first and second argument
-	val* v = val_take(a, 0);
+	val* v = val_pop(a, 0);
 	val* w = val_take(a, 0);
 
-	val* x = val_num(10);
+	long from = val_number(v);
+	long to = val_number(w);
+	val* x;
 
-	if (v->num < w->num) 
+	if (from < to) 
 	{
 		//Count up if second argument greater than first
-		for (int i = v->num; i < w->num; i++) 
+		x = val_qexpr();
+		val_reserve(x, to - from);
+		for (long i = from; i < to; i++) 
 		{
-			x = val_qexpr(); //Somehow insert i into each slot :thinking:
 			x = val_add(x, val_num(i));
 		}
 	}
 	else
 	{
-		if (v->num > w->num) 
+		if (from > to) 
 		{
 			//Count down if second argument less than first
-			for (int i = v->num; i < w->num; i--)
+			x = val_qexpr();
+			val_reserve(x, from - to);
+			for (long i = from; i > to; i--)
 			{
-				x = val_qexpr(); //Somehow insert i into each slot :thinking:
 				x = val_add(x, val_num(i));
 			}
 		}
 		else 
 		{
 			//Must be equal so just return the first number
-			x = v;
+			val_del(w);
+			return v;
 		}
 	}
 
+	val_del(v);
+	val_del(w);
 	return x;
 }
 
@@ -1113,12 +2461,15 @@ val* builtin_load(env* e, val* a) {
 		mpc_ast_delete(r.output);
 
 		//Evaluate each expression
+		gc_push(a);
+		gc_push(expr);
 		while (expr->count) {
 			val* x = val_eval(e, val_pop(expr, 0));
 			//If Evaluation leads to error print it
-			if (x->type == VAL_ERR) { val_println(x); }
+			if (val_type(x) == VAL_ERR) { val_println(x); }
 			val_del(x);
 		}
+		gc_pop(2);
 
 		//Delete expressions and arguments
 		val_del(expr);
@@ -1188,158 +2539,494 @@ val* builtin_read(env* e, val* a) {
 	return x;
 }
 
-void env_add_builtin(env* e, char* name, dsbuiltin func) {
-	val* k = val_sym(name);
-	val* v = val_builtin(func);
-	env_put(e, k, v);
-	val_del(k);
-	val_del(v);
+//Memory statistics - Prints the allocation counters of the val and env slabs and the arena, arguments are ignored
+val* builtin_memstats(env* e, val* a) {
+	slab_print(&val_pool);
+	slab_print(&env_pool);
+	printf("arena %s allocs: %li released: %li promoted: %li peak: %li blocks: %i (%li bytes)\n",
+		arena.enabled ? "on" : "off", arena.allocs, arena.releases, arena.promotions, arena.peak,
+		arena.blocks, (long)(arena.blocks * SLAB_NODES * sizeof(val)));
+
+	val_del(a);
+	return val_sexpr();
 }
 
-void env_add_builtins(env* e) {
-	//Core functions
-	env_add_builtin(e, "lambda", builtin_lambda);
-	env_add_builtin(e, "=", builtin_def);
-	env_add_builtin(e, "put", builtin_put);
-	env_add_builtin(e, "load", builtin_load);
-	env_add_builtin(e, "loop", builtin_loop);
+//Garbage collector mode - 1 to switch to the tracing collector, 0 to go back to freeing on release
+val* builtin_gcmode(env* e, val* a) {
+	ASSERT_NUM("gc_mode", a, 1);
+	ASSERT_TYPE("gc_mode", a, 0, VAL_NUM);
+	ASSERT(a, val_number(a->cell[0]) == 0 || !arena.enabled, "function 'gc_mode' can't enable the collector in arena mode.");
 
-	//Type names
-	env_add_builtin(e, "typeof", builtin_typeof);
-	env_add_builtin(e, "type_name", builtin_typename);
+	int enable = val_number(a->cell[0]) != 0;
+	val_del(a);
 
-	//Output functions
-	env_add_builtin(e, "print", builtin_print);
-	env_add_builtin(e, "println", builtin_println);
-	env_add_builtin(e, "read", builtin_read);
+	//Garbage left unreleased while collecting has to be reclaimed before reference counts are trusted again
+	if (gc_enabled && !enable) { gc_collect(); }
+	gc_enabled = enable;
 
-	//List functions
-	env_add_builtin(e, "list", builtin_list);
-	env_add_builtin(e, "head", builtin_head);
-	env_add_builtin(e, "body", builtin_body);
-	env_add_builtin(e, "tail", builtin_tail);
-	env_add_builtin(e, "pop", builtin_pop);
-	env_add_builtin(e, "len", builtin_len);
-	env_add_builtin(e, "fetch", builtin_fetch);
-	env_add_builtin(e, "eval", builtin_eval);
-	env_add_builtin(e, "join", builtin_join);
-	env_add_builtin(e, "range", builtin_range);
+	return val_sexpr();
+}
 
-	//Mathematical functions
-	env_add_builtin(e, "+", builtin_add);
-	env_add_builtin(e, "-", builtin_sub);
-	env_add_builtin(e, "*", builtin_mul);
-	env_add_builtin(e, "/", builtin_div);
+//Arena mode - 1 to allocate the values of each following top-level form from an arena released when it finishes
+val* builtin_arenamode(env* e, val* a) {
+	ASSERT_NUM("arena_mode", a, 1);
+	ASSERT_TYPE("arena_mode", a, 0, VAL_NUM);
+	ASSERT(a, val_number(a->cell[0]) == 0 || !gc_enabled, "function 'arena_mode' can't enable the arena with the collector enabled.");
 
-	//Comparison functions
-	env_add_builtin(e, "if", builtin_if);
-	env_add_builtin(e, "while", builtin_while);
-	env_add_builtin(e, "==", builtin_equal);
-	env_add_builtin(e, "!=", builtin_notequal);
-	env_add_builtin(e, ">", builtin_greater);
-	env_add_builtin(e, "<", builtin_less);
-	env_add_builtin(e, ">=", builtin_greaterorequal);
-	env_add_builtin(e, "<=", builtin_lessorequal);
+	arena.enabled = val_number(a->cell[0]) != 0;
+	val_del(a);
+
+	return val_sexpr();
 }
 
-val* val_call(env* e, val* f, val* a) {
+//Bytecode mode - 1 to run compiled function bodies, 0 to evaluate them with the tree walker
+val* builtin_vmmode(env* e, val* a) {
+	ASSERT_NUM("vm_mode", a, 1);
+	ASSERT_TYPE("vm_mode", a, 0, VAL_NUM);
 
-	//If builtin then simply apply that
-	if (f->dsbuiltin) { return f->dsbuiltin(e, a); }
+	vm_enabled = val_number(a->cell[0]) != 0;
+	val_del(a);
 
-	//Record argument counts
-	int given = a->count;
-	int total = f->formals->count;
+	return val_sexpr();
+}
 
-	//While arguments still remain to be processed
-	while (a->count) {
+//Maximum depth - Number of nested calls to compiled functions allowed before a call returns an error
+val* builtin_maxdepth(env* e, val* a) {
+	ASSERT_NUM("max_depth", a, 1);
+	ASSERT_TYPE("max_depth", a, 0, VAL_NUM);
+	ASSERT(a, val_number(a->cell[0]) > 0, "function 'max_depth' passed invalid depth %li.", val_number(a->cell[0]));
 
-		//If we've ran out of formal arguments to bind
-		if (f->formals->count == 0) {
-			val_del(a); return val_err("function passed too many arguments; got %i, expected %i.", given, total);
-		}
+	vm.max_depth = val_number(a->cell[0]);
+	val_del(a);
 
-		//Pop the first symbol from the formals
-		val* sym = val_pop(f->formals, 0);
+	return val_sexpr();
+}
 
-		//Special Case to deal with '&'
-		if (strcmp(sym->sym, "&") == 0) {
+//JIT mode - 1 to compile lambdas to native code once called threshold times, 2 to also print the size and compile
+//time of each, 0 to go back to interpreting them
+val* builtin_jitmode(env* e, val* a) {
+	ASSERT(a, a->count == 1 || a->count == 2, "function 'jit_mode' passed incorrect number of arguments; got %i, expected 1 or 2.", a->count);
+	ASSERT_TYPE("jit_mode", a, 0, VAL_NUM);
+	ASSERT(a, JIT_AVAILABLE || val_number(a->cell[0]) == 0, "function 'jit_mode' can't compile native code on this platform.");
+
+	if (a->count == 2) {
+		ASSERT_TYPE("jit_mode", a, 1, VAL_NUM);
+		ASSERT(a, val_number(a->cell[1]) > 0, "function 'jit_mode' passed invalid threshold %li.", val_number(a->cell[1]));
+		jit.threshold = val_number(a->cell[1]);
+	}
 
-			//Ensure '&' is followed by another symbol
-			if (f->formals->count != 1) {
-				val_del(a);
-				return val_err("function format invalid; symbol '&' not followed by single symbol.");
-			}
+	jit.enabled = val_number(a->cell[0]) != 0;
+	jit.verbose = val_number(a->cell[0]) == 2;
+	val_del(a);
 
-			//Next formal should be bound to remaining arguments
-			val* nsym = val_pop(f->formals, 0);
-			env_put(f->env, nsym, builtin_list(e, a));
-			val_del(sym);
-			val_del(nsym);
-			break;
-		}
+	return val_sexpr();
+}
+
+//JIT statistics - Prints how many lambdas were compiled to native code and the time spent doing so
+val* builtin_jitstats(env* e, val* a) {
+	printf("jit  %s threshold: %li compiled: %li failed: %li (%li bytes, %.3fms)\n",
+		jit.enabled ? "on" : "off", jit.threshold, jit.compiled, jit.failed, jit.bytes, jit.time);
+
+	val_del(a);
+	return val_sexpr();
+}
+
+//Garbage collector tuning - minimum live nodes before collecting and heap growth percentage after a collection
+val* builtin_gctune(env* e, val* a) {
+	ASSERT_NUM("gc_tune", a, 2);
+	ASSERT_TYPE("gc_tune", a, 0, VAL_NUM);
+	ASSERT_TYPE("gc_tune", a, 1, VAL_NUM);
+	ASSERT(a, val_number(a->cell[0]) > 0, "function 'gc_tune' passed invalid threshold %li.", val_number(a->cell[0]));
+	ASSERT(a, val_number(a->cell[1]) >= 100, "function 'gc_tune' passed invalid growth %li, must be at least 100.", val_number(a->cell[1]));
 
-		//Pop the next argument from the list
-		val* val = val_pop(a, 0);
+	gc.min_threshold = gc.threshold = val_number(a->cell[0]);
+	gc.growth = val_number(a->cell[1]);
+
+	val_del(a);
+	return val_sexpr();
+}
 
-		//Bind a copy into the function's environment
-		env_put(f->env, sym, val);
+//Garbage collection - Runs a full collection and returns the number of nodes freed, arguments are ignored
+val* builtin_gccollect(env* e, val* a) {
+	val_del(a);
+	return val_num(gc_collect());
+}
+
+//Garbage collector statistics - Prints the collection counters, arguments are ignored
+val* builtin_gcstats(env* e, val* a) {
+	printf("gc   %s collections: %li freed: %li last freed: %li last live: %li threshold: %li growth: %i%% time: %.3fs last: %.3fs\n",
+		gc_enabled ? "on" : "off", gc.collections, gc.freed, gc.last_freed, gc.last_live, gc.threshold, gc.growth, gc.time, gc.last_time);
+
+	val_del(a);
+	return val_sexpr();
+}
 
-		//Delete symbol and value
-		val_del(sym);
-		val_del(val);
+//Memoize - wrap a function so its results are cached by arguments, keeping the limit most recently used if given
+val* builtin_memo(env* e, val* a) {
+	ASSERT(a, a->count == 1 || a->count == 2, "function 'memo' passed incorrect number of arguments; got %i, expected 1 or 2.", a->count);
+	ASSERT_TYPE("memo", a, 0, VAL_FUN);
+
+	long limit = 0;
+	if (a->count == 2) {
+		ASSERT_TYPE("memo", a, 1, VAL_NUM);
+		limit = val_number(a->cell[1]);
+		ASSERT(a, limit >= 0, "function 'memo' passed invalid limit %li.", limit);
 	}
 
-	//Argument list is now bound so can be cleaned up
+	val* v = val_alloc();
+	v->type = VAL_FUN;
+	v->flags |= VAL_MEMO;
+	v->dsbuiltin = NULL;
+	v->applied = val_ref(a->cell[0]);
+	v->memo = memo_new(limit);
+
 	val_del(a);
+	return v;
+}
 
-	//If '&' remains in formal list bind to empty list
-	if (f->formals->count > 0 &&
-		strcmp(f->formals->cell[0]->sym, "&") == 0) {
+//Memo statistics - Prints the entries and counters of a memoized function's table
+val* builtin_memostats(env* e, val* a) {
+	ASSERT_NUM("memo_stats", a, 1);
+	ASSERT_TYPE("memo_stats", a, 0, VAL_FUN);
+	ASSERT(a, val_is_memo(a->cell[0]), "function 'memo_stats' passed a function that isn't memoized.");
 
-		//Check to ensure that & is not passed invalidly
-		if (f->formals->count != 2) {
-			return val_err("Function format invalid; symbol '&' not followed by single symbol.");
+	memo* m = a->cell[0]->memo;
+	printf("memo entries: %li limit: %li hits: %li misses: %li evictions: %li\n",
+		m->count, m->limit, m->hits, m->misses, m->evictions);
+
+	val_del(a);
+	return val_sexpr();
+}
+
+void env_add_builtin(env* e, char* name, dsbuiltin func) {
+	val* k = val_sym(name);
+	val* v = val_builtin(func);
+	env_put(e, k, v);
+	val_del(k);
+	val_del(v);
+}
+
+void env_add_builtins(env* e) {
+	//Core functions
+	env_add_builtin(e, "lambda", builtin_lambda);
+	env_add_builtin(e, "=", builtin_def);
+	env_add_builtin(e, "put", builtin_put);
+	env_add_builtin(e, "load", builtin_load);
+	env_add_builtin(e, "loop", builtin_loop);
+	env_add_builtin(e, "memo", builtin_memo);
+	env_add_builtin(e, "memo_stats", builtin_memostats);
+
+	//Type names
+	env_add_builtin(e, "typeof", builtin_typeof);
+	env_add_builtin(e, "type_name", builtin_typename);
+
+	//Output functions
+	env_add_builtin(e, "print", builtin_print);
+	env_add_builtin(e, "println", builtin_println);
+	env_add_builtin(e, "read", builtin_read);
+	env_add_builtin(e, "mem_stats", builtin_memstats);
+	env_add_builtin(e, "arena_mode", builtin_arenamode);
+	env_add_builtin(e, "vm_mode", builtin_vmmode);
+	env_add_builtin(e, "max_depth", builtin_maxdepth);
+	env_add_builtin(e, "jit_mode", builtin_jitmode);
+	env_add_builtin(e, "jit_stats", builtin_jitstats);
+
+	//Garbage collector
+	env_add_builtin(e, "gc_mode", builtin_gcmode);
+	env_add_builtin(e, "gc_tune", builtin_gctune);
+	env_add_builtin(e, "gc_collect", builtin_gccollect);
+	env_add_builtin(e, "gc_stats", builtin_gcstats);
+
+	//List functions
+	env_add_builtin(e, "list", builtin_list);
+	env_add_builtin(e, "head", builtin_head);
+	env_add_builtin(e, "body", builtin_body);
+	env_add_builtin(e, "tail", builtin_tail);
+	env_add_builtin(e, "pop", builtin_pop);
+	env_add_builtin(e, "len", builtin_len);
+	env_add_builtin(e, "fetch", builtin_fetch);
+	env_add_builtin(e, "eval", builtin_eval);
+	env_add_builtin(e, "join", builtin_join);
+	env_add_builtin(e, "range", builtin_range);
+
+	//Mathematical functions
+	env_add_builtin(e, "+", builtin_add);
+	env_add_builtin(e, "-", builtin_sub);
+	env_add_builtin(e, "*", builtin_mul);
+	env_add_builtin(e, "/", builtin_div);
+
+	//Comparison functions
+	env_add_builtin(e, "if", builtin_if);
+	env_add_builtin(e, "select", builtin_select);
+	env_add_builtin(e, "while", builtin_while);
+	env_add_builtin(e, "==", builtin_equal);
+	env_add_builtin(e, "!=", builtin_notequal);
+	env_add_builtin(e, ">", builtin_greater);
+	env_add_builtin(e, "<", builtin_less);
+	env_add_builtin(e, ">=", builtin_greaterorequal);
+	env_add_builtin(e, "<=", builtin_lessorequal);
+
+	//Catch-all condition for select
+	val* k = val_sym("otherwise");
+	env_put(e, k, val_num(1));
+	val_del(k);
+}
+
+//Create the function value a call runs as, sharing the formals, body and code of the template f with its frame e
+val* val_bound(val* f, env* e) {
+	val* v = val_alloc();
+	v->type = VAL_FUN;
+	v->dsbuiltin = NULL;
+	v->env = e;
+	v->formals = val_ref(f->formals);
+	v->body = val_ref(f->body);
+	v->compiled = f->compiled;
+	if (v->compiled) { v->compiled->refs++; }
+	return v;
+}
+
+//Create a partial application of the lambda f to the arguments in args
+val* val_partial(val* f, val* args) {
+	val* v = val_alloc();
+	v->type = VAL_FUN;
+	v->flags |= VAL_PARTIAL;
+	v->dsbuiltin = NULL;
+	v->applied = val_ref(f);
+	v->args = args;
+	return v;
+}
+
+//Find the entry for a list of arguments, moving it to the front of the list of recently used entries
+memo_entry* memo_find(memo* m, unsigned long hash, val* a) {
+	for (memo_entry* x = m->buckets[hash & (m->capacity - 1)]; x; x = x->chain) {
+		if (x->hash != hash || x->args->count != a->count) { continue; }
+
+		int same = 1;
+		for (int i = 0; i < a->count && same; i++) { same = val_equal(x->args->cell[i], a->cell[i]); }
+		if (!same) { continue; }
+
+		if (m->newest != x) {
+			//Unlink and put it in front
+			x->newer->older = x->older;
+			if (x->older) { x->older->newer = x->newer; } else { m->oldest = x->newer; }
+			x->newer = NULL;
+			x->older = m->newest;
+			m->newest->newer = x;
+			m->newest = x;
+		}
+		return x;
+	}
+	return NULL;
+}
+
+//Drop the least recently used entry
+void memo_evict(memo* m) {
+	memo_entry* x = m->oldest;
+	memo_entry** link = &m->buckets[x->hash & (m->capacity - 1)];
+	while (*link != x) { link = &(*link)->chain; }
+	*link = x->chain;
+
+	m->oldest = x->newer;
+	if (m->oldest) { m->oldest->older = NULL; } else { m->newest = NULL; }
+
+	val_del(x->args);
+	val_del(x->result);
+	free(x);
+	m->count--;
+	m->evictions++;
+}
+
+//Add an entry, taking the references to args and result
+void memo_insert(memo* m, unsigned long hash, val* args, val* result) {
+	//Keep at most one entry per bucket on average
+	if (m->count == m->capacity) {
+		long capacity = m->capacity * 2;
+		memo_entry** buckets = calloc(capacity, sizeof(memo_entry*));
+		for (memo_entry* x = m->newest; x; x = x->older) {
+			memo_entry** b = &buckets[x->hash & (capacity - 1)];
+			x->chain = *b;
+			*b = x;
 		}
+		free(m->buckets);
+		m->buckets = buckets;
+		m->capacity = capacity;
+	}
+
+	memo_entry* x = malloc(sizeof(memo_entry));
+	x->hash = hash;
+	x->args = args;
+	x->result = result;
+
+	memo_entry** b = &m->buckets[hash & (m->capacity - 1)];
+	x->chain = *b;
+	*b = x;
 
-		//Pop and delete '&' symbol
-		val_del(val_pop(f->formals, 0));
+	x->newer = NULL;
+	x->older = m->newest;
+	if (m->newest) { m->newest->newer = x; } else { m->oldest = x; }
+	m->newest = x;
+	m->count++;
 
-		//Pop next symbol and create empty list
-		val* sym = val_pop(f->formals, 0);
-		val* val = val_qexpr();
+	if (m->limit && m->count > m->limit) { memo_evict(m); }
+}
+
+val* val_call(env* e, val* f, val* a);
+
+//Call a memoized function, returning the cached result if it has been called with equal arguments before
+val* val_call_memo(env* e, val* f, val* a) {
+	memo* m = f->memo;
+	unsigned long hash = val_hash(a);
+
+	memo_entry* x = memo_find(m, hash, a);
+	if (x) {
+		m->hits++;
+		val_del(a);
+		return val_ref(x->result);
+	}
+	m->misses++;
+
+	//Keep the arguments as the key, the call moves them out of the list
+	val* key = val_copy(a);
+	gc_push(key);
+	val* result = val_call(e, f->applied, a);
+	if (result == VAL_TAIL) { result = val_eval_pending(); }
+	gc_pop(1);
+
+	//Errors may be down to how deep the call was made rather than the arguments, so aren't kept
+	if (val_type(result) == VAL_ERR) {
+		val_del(key);
+		return result;
+	}
+
+	//The table outlives the current form so it keeps its entries out of the arena
+	key = val_promote(key);
+	result = val_promote(result);
+	memo_insert(m, hash, key, val_ref(result));
+	return result;
+}
+
+val* jit_call(env* e, val* f, val* a);
+
+val* val_call(env* e, val* f, val* a) {
+
+	//If builtin then simply apply that
+	if (f->dsbuiltin) { return f->dsbuiltin(e, a); }
+
+	if (val_is_memo(f)) { return val_call_memo(e, f, a); }
+
+	//Arguments are moved into the call's frame so the list must not be shared
+	a = val_own(a);
+
+	//Calls are the garbage collector's safe point, the function and arguments are this frame's only temporaries
+	gc_push(f);
+	gc_push(a);
+	gc_maybe();
+	gc_pop(2);
 
-		//Bind to environment and delete
-		env_put(f->env, sym, val);
-		val_del(sym);
-		val_del(val);
+	//A partial application calls its lambda with the arguments it holds followed by these
+	val* prior = NULL;
+	if (val_is_partial(f)) {
+		prior = f->args;
+		f = f->applied;
 	}
+	int held = prior ? prior->count : 0;
 
-	//If all formals have been bound evaluate
-	if (f->formals->count == 0) {
+	//Hot lambdas without captured variables may run as native code
+	if (!prior && jit.enabled && f->compiled && !f->env->count) {
+		val* x = jit_call(e, f, a);
+		if (x) { return x; }
+	}
 
-		//Set environment parent to evaluation environment
-		f->env->par = e;
+	//The function is a template left untouched, its formals are read in place
+	val* formals = f->formals;
+	int given = held + a->count;
+	int total = formals->count;
 
-		//Evaluate and return
-		return builtin_eval(f->env, val_add(val_sexpr(), val_copy(f->body)));
+	//Find '&' and check the arguments fit before binding any of them
+	int amp = -1;
+	for (int i = 0; i < total; i++) {
+		if (formals->cell[i]->sym == sym_amp) { amp = i; break; }
 	}
-	else {
-		//Otherwise return partially evaluated function
-		return val_copy(f);
+
+	if (amp < 0 && given > total) {
+		val_del(a);
+		return val_err("function passed too many arguments; got %i, expected %i.", given - held, total - held);
 	}
+
+	//Ensure '&' is followed by another symbol once it is reached
+	if (amp >= 0 && amp != total - 2 && given >= amp) {
+		val_del(a);
+		return val_err_msg(given > amp
+			? "function format invalid; symbol '&' not followed by single symbol."
+			: "Function format invalid; symbol '&' not followed by single symbol.");
+	}
+
+	//Too few arguments, hold on to them all until the rest are given
+	if (given < total && (amp < 0 || given < amp)) {
+		val* args = a;
+		if (prior) {
+			args = val_qexpr();
+			val_reserve(args, given);
+			for (int i = 0; i < held; i++) { args->cell[args->count++] = val_ref(prior->cell[i]); }
+			args = val_join(args, a);
+		}
+		args->type = VAL_QEXPR;
+		return val_partial(f, args);
+	}
+
+	//Start the frame from the variables the lambda captured
+	env* frame = f->env->count ? env_copy(f->env) : env_new();
+
+	//Bind the arguments held by a partial application, then move each new one into the frame
+	int bound = 0;
+	while (bound < given && bound != amp) {
+		val* x = bound < held ? val_ref(prior->cell[bound]) : a->cell[bound - held];
+		env_bind(frame, formals->cell[bound]->sym, x);
+		bound++;
+	}
+
+	//Bind the symbol after '&' to the remaining arguments, an empty list if there are none
+	if (bound == amp) {
+		val* rest = val_qexpr();
+		val_reserve(rest, given - bound);
+		for (int i = bound; i < given; i++) {
+			rest->cell[rest->count++] = i < held ? val_ref(prior->cell[i]) : a->cell[i - held];
+		}
+		env_bind(frame, formals->cell[amp + 1]->sym, rest);
+	}
+
+	//Argument list has been emptied into the frame so can be cleaned up
+	a->count = 0;
+	val_del(a);
+
+	//Set environment parent to evaluation environment
+	frame->par = e;
+
+	//Leave the body to be evaluated in tail position, the call is released once that is done
+	val* call = val_bound(f, frame);
+	if (call->compiled && vm_enabled) {
+		return val_tail_eval(frame, NULL, call);
+	}
+	val* x = val_own(val_ref(call->body));
+	x->type = VAL_SEXPR;
+	return val_tail_eval(frame, x, call);
 }
 
 val* val_eval_sexpr(env* e, val* v) {
 
-	//Evaluate children
+	//Children are replaced by their results so the expression must not be shared
+	v = val_own(v);
+
+	//Evaluate children, keeping the expression rooted for the garbage collector
+	gc_push(v);
 	for (int i = 0; i < v->count; i++) {
 		v->cell[i] = val_eval(e, v->cell[i]);
 	}
+	gc_pop(1);
 
 	//Error Checking
 	for (int i = 0; i < v->count; i++) {
-		if (v->cell[i]->type == VAL_ERR) { return val_take(v, i); }
+		if (val_type(v->cell[i]) == VAL_ERR) { return val_take(v, i); }
 	}
 
 	//Empty expression
@@ -1348,38 +3035,1065 @@ val* val_eval_sexpr(env* e, val* v) {
 	//Single expression
 	if (v->count == 1) { return val_take(v, 0); }
 
+	//Core operators on numbers are applied directly
+	if (v->count <= 3) {
+		val* x = val_arith(v->cell[0], v->cell + 1, v->count - 1);
+		if (x) {
+			val_del(v);
+			return x;
+		}
+	}
+
 	//Ensure first element is a function after evaluation
 	val* f = val_pop(v, 0);
-	if (f->type != VAL_FUN)
+	if (val_type(f) != VAL_FUN)
 	{
-		val* err = val_err("sexpression starts with incorrect type; got %s, expected %s.", type_name(f->type), type_name(VAL_FUN));
+		val* err = val_err("sexpression starts with incorrect type; got %s, expected %s.", type_name(val_type(f)), type_name(VAL_FUN));
 		val_del(f);
 		val_del(v);
 		return err;
 	}
 
 	//Call builtin with operator
+	gc_push(f);
+	gc_push(v);
 	val* result = val_call(e, f, v);
+	gc_pop(2);
 
 	val_del(f);
 	return result;
 }
 
-val* val_eval(env* e, val* v) {
-	if (v->type == VAL_SYM) {
-		val* x = env_get(e, v);
+//Evaluate an expression, returning VAL_TAIL if evaluation was left pending by a call in tail position
+val* val_eval_step(env* e, val* v) {
+	if (val_type(v) == VAL_SYM) {
+		//Symbols resolved to a slot of the current frame are read directly
+		if (v->slot >= 0 && v->slot < e->count && e->syms[v->slot] == v->sym) {
+			val* x = val_ref(e->vals[v->slot]);
+			val_del(v);
+			return x;
+		}
+
+		val* x = env_lookup(e, v);
 		val_del(v);
 		return x;
 	}
-	if (v->type == VAL_SEXPR) { return val_eval_sexpr(e, v); }
+	if (val_type(v) == VAL_SEXPR) {
+		if (NATIVE_EXHAUSTED(&v)) {
+			val_del(v);
+			return val_err_msg("evaluation nested too deeply for the native stack.");
+		}
+		return val_eval_sexpr(e, v);
+	}
 	return v;
 }
 
+//Carry on evaluating what tail calls left pending until there is a value
+val* val_eval_pending(void) {
+	env* e = tail.env;
+	val* v = tail.expr;
+	val* owner = tail.owner;
+
+	//The function whose frame is evaluated in is rooted while it is
+	int root = gc.nroots;
+	gc_push(owner);
+
+	while (1) {
+		val* x = v ? val_eval_step(e, v) : vm_run(e, owner->compiled);
+
+		if (x != VAL_TAIL) {
+			gc_pop(1);
+			if (owner) { val_del(owner); }
+			return x;
+		}
+
+		//A tail call to a function moves evaluation into its frame, taking over the rest of the current one
+		if (tail.owner) {
+			if (owner) {
+				//Frames of anything but the current one are left for a nested loop to release
+				if (tail.owner->env->par != owner->env) {
+					x = val_eval_pending();
+					gc_pop(1);
+					val_del(owner);
+					return x;
+				}
+				env_merge(tail.owner->env, owner->env);
+				val_del(owner);
+			}
+			owner = tail.owner;
+			gc.roots[root] = owner;
+		}
+		e = tail.env;
+		v = tail.expr;
+	}
+}
+
+val* val_eval(env* e, val* v) {
+	val* x = val_eval_step(e, v);
+	return x == VAL_TAIL ? val_eval_pending() : x;
+}
+
+//Compiler state, depth tracks how many values the code emitted so far leaves on the stack
+typedef struct compiler {
+	code* c;
+	int depth;
+	int fold; //Whether calls of pure builtins on constants are folded
+} compiler;
+
+void code_emit(compiler* cs, int op) {
+	code* c = cs->c;
+	if (c->count == c->capacity) {
+		c->capacity = c->capacity ? c->capacity * 2 : 16;
+		c->ops = realloc(c->ops, sizeof(int) * c->capacity);
+	}
+	c->ops[c->count++] = op;
+}
+
+//Add a constant, taking the reference passed in, and return its index
+int code_const(compiler* cs, val* v) {
+	code* c = cs->c;
+	c->consts = realloc(c->consts, sizeof(val*) * (c->nconsts + 1));
+	c->consts[c->nconsts] = v;
+	return c->nconsts++;
+}
+
+//Account for values pushed, or popped if n is negative
+void code_stack(compiler* cs, int n) {
+	cs->depth += n;
+	if (cs->depth > cs->c->max_stack) { cs->c->max_stack = cs->depth; }
+}
+
+//Emit a jump operand to be patched later, returning its position
+int code_label(compiler* cs) {
+	code_emit(cs, -1);
+	return cs->c->count - 1;
+}
+
+//Point a jump operand at the next instruction
+void code_patch(compiler* cs, int label) {
+	cs->c->ops[label] = cs->c->count;
+}
+
+void vm_compile_list(compiler* cs, val* l, int tail);
+
+//Compile an expression to leave its value on the stack, a call in tail position returns its result
+void vm_compile_expr(compiler* cs, val* v, int tail) {
+	switch (val_type(v)) {
+	case VAL_SYM:
+		//Formals are read from their frame slot, everything else is looked up by name
+		if (v->slot >= 0) {
+			code_emit(cs, OP_LOCAL);
+			code_emit(cs, v->slot);
+			code_emit(cs, code_const(cs, val_ref(v)));
+		}
+		else {
+			code_emit(cs, OP_NAME);
+			code_emit(cs, code_const(cs, val_ref(v)));
+		}
+		code_stack(cs, 1);
+		break;
+	case VAL_SEXPR:
+		vm_compile_list(cs, v, tail);
+		break;
+	default:
+		//Everything else evaluates to itself
+		code_emit(cs, OP_CONST);
+		code_emit(cs, code_const(cs, val_ref(v)));
+		code_stack(cs, 1);
+		break;
+	}
+}
+
+//Compile (if cond {then} {else}) to evaluate only the branch taken without building the argument list,
+//guarded by a check that if is still the builtin falling back to the tree walker otherwise
+void vm_compile_if(compiler* cs, val* l, int tail) {
+	code_emit(cs, OP_GUARD);
+	code_emit(cs, code_const(cs, val_ref(l->cell[0])));
+	code_emit(cs, code_const(cs, val_builtin(builtin_if)));
+	int fallback = code_label(cs);
+
+	vm_compile_expr(cs, l->cell[1], 0);
+	code_emit(cs, OP_TEST);
+	int other = code_label(cs);
+	int end = code_label(cs);
+	code_emit(cs, code_const(cs, val_ref(l->cell[0])));
+	code_emit(cs, 0);
+	code_stack(cs, -1);
+
+	vm_compile_list(cs, l->cell[2], tail);
+	code_emit(cs, OP_JUMP);
+	int end_then = code_label(cs);
+	code_stack(cs, -1);
+
+	code_patch(cs, other);
+	vm_compile_list(cs, l->cell[3], tail);
+	code_emit(cs, OP_JUMP);
+	int end_else = code_label(cs);
+	code_stack(cs, -1);
+
+	//The tree walker needs an S-Expression, the list may be a Q-Expression body or branch
+	code_patch(cs, fallback);
+	val* x = val_copy(l);
+	x->type = VAL_SEXPR;
+	code_emit(cs, OP_EVAL);
+	code_emit(cs, code_const(cs, x));
+	code_stack(cs, 1);
+
+	code_patch(cs, end);
+	code_patch(cs, end_then);
+	code_patch(cs, end_else);
+}
+
+//Whether every argument of a select is a {condition expression} clause
+int vm_select_clauses(val* l) {
+	for (int i = 1; i < l->count; i++) {
+		if (val_type(l->cell[i]) != VAL_QEXPR || l->cell[i]->count != 2) { return 0; }
+	}
+	return 1;
+}
+
+//Compile (select {cond expr} ...) to test each condition in turn and evaluate the expression of the first true
+//one, guarded the same way as if
+void vm_compile_select(compiler* cs, val* l, int tail) {
+	code_emit(cs, OP_GUARD);
+	code_emit(cs, code_const(cs, val_ref(l->cell[0])));
+	code_emit(cs, code_const(cs, val_builtin(builtin_select)));
+	int fallback = code_label(cs);
+
+	int* ends = malloc(sizeof(int) * l->count * 2);
+	int nends = 0;
+
+	for (int i = 1; i < l->count; i++) {
+		vm_compile_expr(cs, l->cell[i]->cell[0], 0);
+		code_emit(cs, OP_TEST);
+		int next = code_label(cs);
+		ends[nends++] = code_label(cs);
+		code_emit(cs, code_const(cs, val_ref(l->cell[0])));
+		code_emit(cs, i - 1);
+		code_stack(cs, -1);
+
+		vm_compile_expr(cs, l->cell[i]->cell[1], tail);
+		code_emit(cs, OP_JUMP);
+		ends[nends++] = code_label(cs);
+		code_stack(cs, -1);
+		code_patch(cs, next);
+	}
+
+	//No condition was true
+	code_emit(cs, OP_CONST);
+	code_emit(cs, code_const(cs, val_err_msg("function 'select' found no true condition.")));
+	code_emit(cs, OP_JUMP);
+	ends[nends++] = code_label(cs);
+
+	code_patch(cs, fallback);
+	val* x = val_copy(l);
+	x->type = VAL_SEXPR;
+	code_emit(cs, OP_EVAL);
+	code_emit(cs, code_const(cs, x));
+	code_stack(cs, 1);
+
+	for (int i = 0; i < nends; i++) { code_patch(cs, ends[i]); }
+	free(ends);
+}
+
+//Builtins without side effects, calls of them on constants are computed when a lambda is compiled
+typedef struct pure_builtin {
+	char* name; //Interned when the interpreter starts, so symbols are matched by pointer
+	dsbuiltin func;
+} pure_builtin;
+
+pure_builtin pure_builtins[] = {
+	{ "+", builtin_add }, { "-", builtin_sub }, { "*", builtin_mul }, { "/", builtin_div },
+	{ ">", builtin_greater }, { "<", builtin_less }, { ">=", builtin_greaterorequal }, { "<=", builtin_lessorequal },
+	{ "==", builtin_equal }, { "!=", builtin_notequal }
+};
+
+#define PURE_BUILTINS (sizeof(pure_builtins) / sizeof(pure_builtin))
+
+//The pure builtin a symbol is named after, NULL if there isn't one or it names a formal
+dsbuiltin vm_pure(val* v) {
+	if (val_type(v) != VAL_SYM || v->slot >= 0) { return NULL; }
+	for (size_t i = 0; i < PURE_BUILTINS; i++) {
+		if (v->sym == pure_builtins[i].name) { return pure_builtins[i].func; }
+	}
+	return NULL;
+}
+
+//Compute a call of pure builtins on constants, adding the symbols naming them to guards
+//Returns NULL if anything in it isn't constant or the result is an error, which is left to be raised when run
+val* vm_fold(val* l, val* guards) {
+	if (l->count < 2) { return NULL; }
+
+	dsbuiltin func = vm_pure(l->cell[0]);
+	if (!func) { return NULL; }
+
+	val* a = val_sexpr();
+	for (int i = 1; i < l->count; i++) {
+		val* x = l->cell[i];
+		switch (val_type(x)) {
+		case VAL_NUM:
+		case VAL_STR:
+		case VAL_QEXPR:
+			a = val_add(a, val_ref(x));
+			break;
+		case VAL_SEXPR:
+			x = vm_fold(x, guards);
+			if (!x) {
+				val_del(a);
+				return NULL;
+			}
+			a = val_add(a, x);
+			break;
+		default:
+			//Symbols are looked up when the function runs
+			val_del(a);
+			return NULL;
+		}
+	}
+
+	val* x = func(NULL, a);
+	if (val_type(x) == VAL_ERR) {
+		val_del(x);
+		return NULL;
+	}
+
+	for (int i = 0; i < guards->count; i++) {
+		if (guards->cell[i]->sym == l->cell[0]->sym) { return x; }
+	}
+	val_add(guards, val_ref(l->cell[0]));
+	return x;
+}
+
+//Compile the elements of a list evaluated as an S-Expression, a call in tail position returns its result
+void vm_compile_list(compiler* cs, val* l, int tail) {
+	//Empty expressions evaluate to themselves
+	if (l->count == 0) {
+		code_emit(cs, OP_CONST);
+		code_emit(cs, code_const(cs, val_sexpr()));
+		code_stack(cs, 1);
+		return;
+	}
+
+	//Single expressions evaluate to their element
+	if (l->count == 1) {
+		vm_compile_expr(cs, l->cell[0], tail);
+		return;
+	}
+
+	val* head = l->cell[0];
+	if (val_type(head) == VAL_SYM && head->sym == sym_if && head->slot < 0 && l->count == 4
+		&& val_type(l->cell[2]) == VAL_QEXPR && val_type(l->cell[3]) == VAL_QEXPR) {
+		vm_compile_if(cs, l, tail);
+		return;
+	}
+
+	if (val_type(head) == VAL_SYM && head->sym == sym_select && head->slot < 0 && vm_select_clauses(l)) {
+		vm_compile_select(cs, l, tail);
+		return;
+	}
+
+	//Calls of pure builtins on constants push their result, guarded by checks that each symbol is still bound to
+	//the builtin it is named after falling back to making the calls otherwise
+	val* guards = val_qexpr();
+	val* k = cs->fold ? vm_fold(l, guards) : NULL;
+	int end = -1;
+	if (k) {
+		int* fallbacks = malloc(sizeof(int) * guards->count);
+		for (int i = 0; i < guards->count; i++) {
+			code_emit(cs, OP_GUARD);
+			code_emit(cs, code_const(cs, val_ref(guards->cell[i])));
+			code_emit(cs, code_const(cs, val_builtin(vm_pure(guards->cell[i]))));
+			fallbacks[i] = code_label(cs);
+		}
+
+		code_emit(cs, OP_CONST);
+		code_emit(cs, code_const(cs, k));
+		code_emit(cs, OP_JUMP);
+		end = code_label(cs);
+
+		for (int i = 0; i < guards->count; i++) { code_patch(cs, fallbacks[i]); }
+		free(fallbacks);
+		cs->fold = 0;
+	}
+	val_del(guards);
+
+	//Otherwise push the function and its arguments and call it
+	for (int i = 0; i < l->count; i++) {
+		vm_compile_expr(cs, l->cell[i], 0);
+	}
+	code_emit(cs, tail ? OP_TAIL_CALL : OP_CALL);
+	code_emit(cs, l->count);
+	code_stack(cs, 1 - l->count);
+
+	if (k) {
+		code_patch(cs, end);
+		cs->fold = 1;
+	}
+}
+
+//Compile the body of a function, its symbols must already be resolved against the formals
+code* vm_compile(val* body) {
+	compiler cs = { calloc(1, sizeof(code)), 0, 1 };
+	cs.c->refs = 1;
+
+	vm_compile_list(&cs, body, 1);
+	code_emit(&cs, OP_RETURN);
+	return cs.c;
+}
+
+//Apply the function n values down the stack to the values above it, popping them all
+val* vm_call(env* e, int n) {
+	vm.sp -= n;
+	val** items = vm.stack + vm.sp;
+
+	//The first error is the result
+	for (int i = 0; i < n; i++) {
+		if (val_type(items[i]) == VAL_ERR) {
+			val* err = val_ref(items[i]);
+			for (int j = 0; j < n; j++) { val_del(items[j]); }
+			return err;
+		}
+	}
+
+	//Ensure first element is a function
+	val* f = items[0];
+	if (val_type(f) != VAL_FUN) {
+		val* err = val_err("sexpression starts with incorrect type; got %s, expected %s.", type_name(val_type(f)), type_name(VAL_FUN));
+		for (int j = 0; j < n; j++) { val_del(items[j]); }
+		return err;
+	}
+
+	//Core operators on numbers are applied directly, the result takes the place of the call on the stack
+	if (n <= 3) {
+		val* x = val_arith(f, items + 1, n - 1);
+		if (x) {
+			for (int j = 0; j < n; j++) { val_del(items[j]); }
+			return x;
+		}
+	}
+
+	//Move the arguments into a list to pass, the stack may be reallocated by the call
+	val* a = val_sexpr();
+	val_reserve(a, n - 1);
+	memcpy(a->cell, items + 1, sizeof(val*) * (n - 1));
+	a->count = n - 1;
+
+	gc_push(f);
+	gc_push(a);
+	val* x = val_call(e, f, a);
+	gc_pop(2);
+
+	val_del(f);
+	return x;
+}
+
+//Make room for every value code pushes
+void vm_reserve(code* c) {
+	if (vm.sp + c->max_stack > vm.capacity) {
+		while (vm.sp + c->max_stack > vm.capacity) { vm.capacity = vm.capacity ? vm.capacity * 2 : 256; }
+		vm.stack = realloc(vm.stack, sizeof(val*) * vm.capacity);
+	}
+}
+
+//Run compiled code in a function's frame. Calls to other compiled functions push a frame and continue in the
+//same loop, so only builtins that evaluate expressions themselves recurse on the C stack
+val* vm_run(env* e, code* c) {
+	if (NATIVE_EXHAUSTED(&e)) {
+		return val_err_msg("evaluation nested too deeply for the native stack.");
+	}
+	vm_reserve(c);
+
+	//Frames pushed by this run, the first one's function is owned by the caller
+	long entry = vm.nframes;
+	int* ip = c->ops;
+	val** k = c->consts;
+	val* x;
+
+	while (1) {
+		switch (*ip++) {
+		case OP_CONST:
+			vm.stack[vm.sp++] = val_ref(k[*ip++]);
+			break;
+
+		case OP_LOCAL: {
+			//The slot is a hint checked against the frame as with resolved symbols in the tree walker
+			int slot = *ip++;
+			val* sym = k[*ip++];
+			vm.stack[vm.sp++] = slot < e->count && e->syms[slot] == sym->sym ? val_ref(e->vals[slot]) : env_get(e, sym);
+			break;
+		}
+
+		case OP_NAME:
+			vm.stack[vm.sp++] = env_lookup(e, k[*ip++]);
+			break;
+
+		case OP_CALL:
+			x = vm_call(e, *ip++);
+			if (x == VAL_TAIL) {
+				//Expressions left pending by builtins are evaluated by the tree walker
+				if (tail.expr) {
+					x = val_eval_pending();
+				}
+				else if (vm.nframes >= vm.max_depth) {
+					val_del(tail.owner);
+					x = val_err("maximum call depth of %li exceeded.", vm.max_depth);
+				}
+				else {
+					//Save where to continue and enter the called function
+					if (vm.nframes == vm.frames_capacity) {
+						vm.frames_capacity = vm.frames_capacity ? vm.frames_capacity * 2 : 64;
+						vm.frames = realloc(vm.frames, sizeof(vm_frame) * vm.frames_capacity);
+					}
+					vm_frame* f = &vm.frames[vm.nframes++];
+					f->owner = tail.owner;
+					f->c = c;
+					f->ip = ip;
+					f->e = e;
+
+					e = tail.env;
+					c = tail.owner->compiled;
+					vm_reserve(c);
+					ip = c->ops;
+					k = c->consts;
+					break;
+				}
+			}
+			vm.stack[vm.sp++] = x;
+			break;
+
+		case OP_TAIL_CALL:
+			x = vm_call(e, *ip);
+
+			//The first frame hands tail calls back to val_eval
+			if (vm.nframes == entry) { return x; }
+
+			if (x == VAL_TAIL) {
+				//A compiled function called from the frame takes it over
+				vm_frame* f = &vm.frames[vm.nframes - 1];
+				if (!tail.expr && tail.owner->env->par == e) {
+					env_merge(tail.owner->env, e);
+					val_del(f->owner);
+					f->owner = tail.owner;
+
+					e = tail.env;
+					c = tail.owner->compiled;
+					vm_reserve(c);
+					ip = c->ops;
+					k = c->consts;
+					break;
+				}
+				x = val_eval_pending();
+			}
+			goto ret;
+
+		case OP_GUARD: {
+			val* y = env_lookup(e, k[ip[0]]);
+			int same = val_type(y) == VAL_FUN && y->dsbuiltin == k[ip[1]]->dsbuiltin;
+			val_del(y);
+			ip = same ? ip + 3 : c->ops + ip[2];
+			break;
+		}
+
+		case OP_TEST:
+			x = vm.stack[vm.sp - 1];
+			if (val_type(x) == VAL_NUM) {
+				vm.sp--;
+				ip = val_number(x) ? ip + 4 : c->ops + ip[0];
+				val_del(x);
+				break;
+			}
+
+			//An error condition is the result, anything else is the error the builtin would raise
+			if (val_type(x) != VAL_ERR) {
+				vm.stack[vm.sp - 1] = val_err_code(ERR_TYPE, k[ip[2]]->sym, ip[3], 0, val_type(x), VAL_NUM, 0);
+				val_del(x);
+			}
+			ip = c->ops + ip[1];
+			break;
+
+		case OP_JUMP:
+			ip = c->ops + *ip;
+			break;
+
+		case OP_EVAL:
+			vm.stack[vm.sp++] = val_eval(e, val_ref(k[*ip++]));
+			break;
+
+		case OP_RETURN:
+			x = vm.stack[--vm.sp];
+		ret:
+			if (vm.nframes == entry) { return x; }
+
+			//Release the returning call and continue in its caller
+			vm_frame* f = &vm.frames[--vm.nframes];
+			val_del(f->owner);
+			c = f->c;
+			ip = f->ip;
+			e = f->e;
+			k = c->consts;
+			vm.stack[vm.sp++] = x;
+			break;
+		}
+	}
+}
+
+//JIT - once a lambda has been called jit.threshold times its body is compiled to x86-64 machine code if it only
+//uses its formals, numbers, the arithmetic and comparison builtins, if, select and calls to itself. Native code
+//works on the arguments as plain longs and is only run when they are all numbers and the globals it was
+//compiled against are still bound the same way. Anything it can't finish (division by zero, no true select
+//condition, running low on stack) makes it bail out and the call is run by the interpreter from the start,
+//which is safe as nothing it does has side effects
+#if JIT_AVAILABLE
+
+//Set by native code that bails out, and the lowest the stack may grow to before it does
+int jit_bail;
+char* jit_stack_limit;
+
+//Machine code being generated, with jumps to the epilogue and the bail out block patched once they are placed
+typedef struct jit_compiler {
+	unsigned char* buf;
+	int count;
+	int capacity;
+
+	val* f; //Lambda being compiled
+	env* e; //Environment it was called from, to see what the globals it uses are bound to
+	int nformals;
+	int body; //Offset of the body, where tail calls jump back to
+
+	int* exits;
+	int nexits;
+	int* bails;
+	int nbails;
+
+	jit_guard* guards;
+	int nguards;
+} jit_compiler;
+
+void jit_byte(jit_compiler* j, int b) {
+	if (j->count == j->capacity) {
+		j->capacity = j->capacity ? j->capacity * 2 : 256;
+		j->buf = realloc(j->buf, j->capacity);
+	}
+	j->buf[j->count++] = (unsigned char)b;
+}
+
+void jit_code(jit_compiler* j, char* s, int n) {
+	for (int i = 0; i < n; i++) { jit_byte(j, (unsigned char)s[i]); }
+}
+
+void jit_int(jit_compiler* j, int x) {
+	for (int i = 0; i < 4; i++) { jit_byte(j, (x >> (i * 8)) & 0xff); }
+}
+
+void jit_long(jit_compiler* j, long x) {
+	for (int i = 0; i < 8; i++) { jit_byte(j, (x >> (i * 8)) & 0xff); }
+}
+
+//Emit a jump instruction with a 32 bit displacement to be patched later, returning its position
+int jit_jump(jit_compiler* j, char* op, int n) {
+	jit_code(j, op, n);
+	jit_int(j, 0);
+	return j->count - 4;
+}
+
+void jit_patch(jit_compiler* j, int label, int target) {
+	int rel = target - (label + 4);
+	memcpy(j->buf + label, &rel, 4);
+}
+
+void jit_exit(jit_compiler* j, char* op, int n) {
+	j->exits = realloc(j->exits, sizeof(int) * (j->nexits + 1));
+	j->exits[j->nexits++] = jit_jump(j, op, n);
+}
+
+void jit_to_bail(jit_compiler* j, char* op, int n) {
+	j->bails = realloc(j->bails, sizeof(int) * (j->nbails + 1));
+	j->bails[j->nbails++] = jit_jump(j, op, n);
+}
+
+//Record what a global the code relies on must be bound to when it is run
+void jit_guard_add(jit_compiler* j, val* sym, int kind, dsbuiltin func, long num) {
+	for (int i = 0; i < j->nguards; i++) {
+		if (j->guards[i].sym->sym == sym->sym) { return; }
+	}
+
+	//The symbol is kept apart from the body so it stays out of the arena
+	int active = arena.active;
+	arena.active = 0;
+	jit_guard* g;
+	j->guards = realloc(j->guards, sizeof(jit_guard) * (j->nguards + 1));
+	g = &j->guards[j->nguards++];
+	g->sym = val_sym(sym->sym);
+	arena.active = active;
+
+	g->kind = kind;
+	g->func = func;
+	g->num = num;
+}
+
+int jit_list(jit_compiler* j, val* l, int tail);
+
+//The argument a symbol names, -1 if it isn't a formal. Slots are only hints so the formals are searched by name
+int jit_formal(jit_compiler* j, val* v) {
+	for (int i = 0; i < j->nformals; i++) {
+		if (j->f->formals->cell[i]->sym == v->sym) { return i; }
+	}
+	return -1;
+}
+
+//Compile an expression leaving its value in rax, returns 0 if it uses anything unsupported
+int jit_expr(jit_compiler* j, val* v, int tail) {
+	switch (val_type(v)) {
+	case VAL_NUM:
+		jit_code(j, "\x48\xb8", 2); //mov rax, imm64
+		jit_long(j, val_number(v));
+		return 1;
+
+	case VAL_SYM: {
+		//Formals are read from the argument array in rbx
+		int slot = jit_formal(j, v);
+		if (slot >= 0) {
+			jit_code(j, "\x48\x8b\x83", 3); //mov rax, [rbx + disp32]
+			jit_int(j, slot * 8);
+			return 1;
+		}
+
+		//Globals bound to numbers, such as otherwise, are read as constants
+		val* x = env_lookup(j->e, v);
+		int ok = val_type(x) == VAL_NUM;
+		if (ok) {
+			jit_guard_add(j, v, JIT_NUMBER, NULL, val_number(x));
+			jit_code(j, "\x48\xb8", 2); //mov rax, imm64
+			jit_long(j, val_number(x));
+		}
+		val_del(x);
+		return ok;
+	}
+
+	case VAL_SEXPR:
+		return jit_list(j, v, tail);
+	}
+	return 0;
+}
+
+//Compile the arguments of an arithmetic builtin, folding each into rax
+int jit_arith(jit_compiler* j, val* l, dsbuiltin op) {
+	if (!jit_expr(j, l->cell[1], 0)) { return 0; }
+
+	if (l->count == 2) {
+		if (op == builtin_sub) { jit_code(j, "\x48\xf7\xd8", 3); } //neg rax
+		return 1;
+	}
+
+	for (int i = 2; i < l->count; i++) {
+		jit_byte(j, 0x50); //push rax
+		if (!jit_expr(j, l->cell[i], 0)) { return 0; }
+		jit_code(j, "\x48\x89\xc1", 3); //mov rcx, rax
+		jit_byte(j, 0x58); //pop rax
+
+		if (op == builtin_add) { jit_code(j, "\x48\x01\xc8", 3); } //add rax, rcx
+		if (op == builtin_sub) { jit_code(j, "\x48\x29\xc8", 3); } //sub rax, rcx
+		if (op == builtin_mul) { jit_code(j, "\x48\x0f\xaf\xc1", 4); } //imul rax, rcx
+		if (op == builtin_div) {
+			jit_code(j, "\x48\x85\xc9", 3); //test rcx, rcx
+			jit_to_bail(j, "\x0f\x84", 2); //jz bail
+
+			//Dividing by -1 is negation, idiv would fault on the smallest long
+			jit_code(j, "\x48\x83\xf9\xff", 4); //cmp rcx, -1
+			int divide = jit_jump(j, "\x0f\x85", 2); //jne divide
+			jit_code(j, "\x48\xf7\xd8", 3); //neg rax
+			int done = jit_jump(j, "\xe9", 1); //jmp done
+			jit_patch(j, divide, j->count);
+			jit_code(j, "\x48\x99\x48\xf7\xf9", 5); //cqo; idiv rcx
+			jit_patch(j, done, j->count);
+		}
+	}
+	return 1;
+}
+
+//Compile a comparison of two arguments, leaving 1 or 0 in rax
+int jit_compare(jit_compiler* j, val* l, dsbuiltin op) {
+	if (l->count != 3) { return 0; }
+	if (!jit_expr(j, l->cell[1], 0)) { return 0; }
+	jit_byte(j, 0x50); //push rax
+	if (!jit_expr(j, l->cell[2], 0)) { return 0; }
+	jit_code(j, "\x48\x89\xc1", 3); //mov rcx, rax
+	jit_byte(j, 0x58); //pop rax
+	jit_code(j, "\x48\x39\xc8", 3); //cmp rax, rcx
+
+	int cc = 0;
+	if (op == builtin_greater) { cc = 0x9f; } //setg
+	if (op == builtin_less) { cc = 0x9c; } //setl
+	if (op == builtin_greaterorequal) { cc = 0x9d; } //setge
+	if (op == builtin_lessorequal) { cc = 0x9e; } //setle
+	if (op == builtin_equal) { cc = 0x94; } //sete
+	if (op == builtin_notequal) { cc = 0x95; } //setne
+	jit_byte(j, 0x0f);
+	jit_byte(j, cc);
+	jit_byte(j, 0xc0); //al
+	jit_code(j, "\x0f\xb6\xc0", 3); //movzx eax, al
+	return 1;
+}
+
+//Compile a call of the function being compiled, a tail call reuses the argument array and jumps back to the body
+int jit_self(jit_compiler* j, val* l, int tail) {
+	int n = l->count - 1;
+	if (n != j->nformals) { return 0; }
+
+	//Push the arguments last first so the first is at the lowest address
+	for (int i = n; i >= 1; i--) {
+		if (!jit_expr(j, l->cell[i], 0)) { return 0; }
+		jit_byte(j, 0x50); //push rax
+	}
+
+	if (tail) {
+		for (int i = 0; i < n; i++) {
+			jit_byte(j, 0x58); //pop rax
+			jit_code(j, "\x48\x89\x83", 3); //mov [rbx + disp32], rax
+			jit_int(j, i * 8);
+		}
+		int back = jit_jump(j, "\xe9", 1); //jmp body
+		jit_patch(j, back, j->body);
+		return 1;
+	}
+
+	jit_code(j, "\x48\x89\xe7", 3); //mov rdi, rsp
+	int call = jit_jump(j, "\xe8", 1); //call entry
+	jit_patch(j, call, 0);
+	jit_code(j, "\x48\x81\xc4", 3); //add rsp, imm32
+	jit_int(j, n * 8);
+
+	//Keep unwinding if the call bailed out
+	jit_code(j, "\x48\xb9", 2); //mov rcx, &jit_bail
+	jit_long(j, (long)&jit_bail);
+	jit_code(j, "\x83\x39\x00", 3); //cmp dword [rcx], 0
+	jit_exit(j, "\x0f\x85", 2); //jne epilogue
+	return 1;
+}
+
+//Compile the elements of a list evaluated as an S-Expression
+int jit_list(jit_compiler* j, val* l, int tail) {
+	if (l->count == 0) { return 0; }
+	if (l->count == 1) { return jit_expr(j, l->cell[0], tail); }
+
+	val* head = l->cell[0];
+	if (val_type(head) != VAL_SYM || jit_formal(j, head) >= 0) { return 0; }
+
+	if (head->sym == sym_if && l->count == 4 && val_type(l->cell[2]) == VAL_QEXPR && val_type(l->cell[3]) == VAL_QEXPR) {
+		jit_guard_add(j, head, JIT_BUILTIN, builtin_if, 0);
+		if (!jit_expr(j, l->cell[1], 0)) { return 0; }
+		jit_code(j, "\x48\x85\xc0", 3); //test rax, rax
+		int other = jit_jump(j, "\x0f\x84", 2); //jz other
+		if (!jit_list(j, l->cell[2], tail)) { return 0; }
+		int end = jit_jump(j, "\xe9", 1); //jmp end
+		jit_patch(j, other, j->count);
+		if (!jit_list(j, l->cell[3], tail)) { return 0; }
+		jit_patch(j, end, j->count);
+		return 1;
+	}
+
+	if (head->sym == sym_select && vm_select_clauses(l)) {
+		jit_guard_add(j, head, JIT_BUILTIN, builtin_select, 0);
+		int* ends = malloc(sizeof(int) * l->count);
+		int ok = 1;
+		for (int i = 1; i < l->count && ok; i++) {
+			ok = jit_expr(j, l->cell[i]->cell[0], 0);
+			if (!ok) { break; }
+			jit_code(j, "\x48\x85\xc0", 3); //test rax, rax
+			int next = jit_jump(j, "\x0f\x84", 2); //jz next
+			ok = jit_expr(j, l->cell[i]->cell[1], tail);
+			ends[i] = jit_jump(j, "\xe9", 1); //jmp end
+			jit_patch(j, next, j->count);
+		}
+
+		//No condition was true
+		if (ok) {
+			jit_to_bail(j, "\xe9", 1);
+			for (int i = 1; i < l->count; i++) { jit_patch(j, ends[i], j->count); }
+		}
+		free(ends);
+		return ok;
+	}
+
+	dsbuiltin op = vm_pure(head);
+	if (op) {
+		jit_guard_add(j, head, JIT_BUILTIN, op, 0);
+		if (op == builtin_add || op == builtin_sub || op == builtin_mul || op == builtin_div) {
+			return jit_arith(j, l, op);
+		}
+		return jit_compare(j, l, op);
+	}
+
+	//Anything else must be the function itself
+	val* x = env_lookup(j->e, head);
+	int self = val_type(x) == VAL_FUN && !x->dsbuiltin && !val_is_partial(x) && !val_is_memo(x)
+		&& x->compiled == j->f->compiled;
+	val_del(x);
+	if (!self) { return 0; }
+
+	jit_guard_add(j, head, JIT_SELF, NULL, 0);
+	return jit_self(j, l, tail);
+}
+
+void native_del(native* n, void (*release)(val*)) {
+	for (int i = 0; i < n->nguards; i++) { release(n->guards[i].sym); }
+	free(n->guards);
+	munmap((void*)(uintptr_t)n->fn, n->size);
+	free(n);
+}
+
+//Compile a lambda to native code, leaving the compiled body marked as failed if it can't be
+void jit_compile(env* e, val* f) {
+	clock_t start = clock();
+	code* c = f->compiled;
+	jit_compiler j = { 0 };
+	j.f = f;
+	j.e = e;
+	j.nformals = f->formals->count;
+
+	//Formals must all be bound to their own slot
+	int ok = j.nformals > 0;
+	for (int i = 0; i < j.nformals && ok; i++) {
+		char* sym = f->formals->cell[i]->sym;
+		ok = sym != sym_amp;
+		for (int k = 0; k < i && ok; k++) { ok = f->formals->cell[k]->sym != sym; }
+	}
+
+	if (ok) {
+		//Keep the argument array in rbx and bail out if the stack is running low
+		jit_code(&j, "\x55\x48\x89\xe5\x53\x48\x89\xfb", 8); //push rbp; mov rbp, rsp; push rbx; mov rbx, rdi
+		jit_code(&j, "\x48\xb8", 2); //mov rax, &jit_stack_limit
+		jit_long(&j, (long)&jit_stack_limit);
+		jit_code(&j, "\x48\x3b\x20", 3); //cmp rsp, [rax]
+		jit_to_bail(&j, "\x0f\x82", 2); //jb bail
+		j.body = j.count;
+
+		ok = jit_list(&j, f->body, 1);
+	}
+
+	if (ok) {
+		int epilogue = j.count;
+		jit_code(&j, "\x48\x8d\x65\xf8\x5b\x5d\xc3", 7); //lea rsp, [rbp - 8]; pop rbx; pop rbp; ret
+
+		int bail = j.count;
+		jit_code(&j, "\x48\xb9", 2); //mov rcx, &jit_bail
+		jit_long(&j, (long)&jit_bail);
+		jit_code(&j, "\xc7\x01\x01\x00\x00\x00", 6); //mov dword [rcx], 1
+		int back = jit_jump(&j, "\xe9", 1); //jmp epilogue
+		jit_patch(&j, back, epilogue);
+
+		for (int i = 0; i < j.nexits; i++) { jit_patch(&j, j.exits[i], epilogue); }
+		for (int i = 0; i < j.nbails; i++) { jit_patch(&j, j.bails[i], bail); }
+
+		//Copy into pages that are made executable once written
+		void* mem = mmap(NULL, j.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) {
+			ok = 0;
+		}
+		else {
+			memcpy(mem, j.buf, j.count);
+			mprotect(mem, j.count, PROT_READ | PROT_EXEC);
+
+			native* n = malloc(sizeof(native));
+			n->fn = (long (*)(long*))(uintptr_t)mem;
+			n->size = j.count;
+			n->nformals = j.nformals;
+			n->nguards = j.nguards;
+			n->guards = j.guards;
+			j.guards = NULL;
+			j.nguards = 0;
+			c->native = n;
+		}
+	}
+
+	double ms = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+	jit.time += ms;
+	if (ok) {
+		jit.compiled++;
+		jit.bytes += j.count;
+		if (jit.verbose) { printf("jit  compiled %i bytes in %.3fms\n", j.count, ms); }
+	}
+	else {
+		c->jit_failed = 1;
+		jit.failed++;
+		if (jit.verbose) { printf("jit  left to the interpreter after %.3fms\n", ms); }
+	}
+
+	for (int i = 0; i < j.nguards; i++) { val_del(j.guards[i].sym); }
+	free(j.guards);
+	free(j.buf);
+	free(j.exits);
+	free(j.bails);
+}
+
+//Run a call to a lambda as native code if it has been compiled, or is now hot enough to compile, and the
+//arguments and globals allow it. Returns the result, or NULL to leave the call to the interpreter
+val* jit_call(env* e, val* f, val* a) {
+	code* c = f->compiled;
+	if (!c->native) {
+		if (c->jit_failed || ++c->calls < jit.threshold) { return NULL; }
+		jit_compile(e, f);
+		if (!c->native) { return NULL; }
+	}
+
+	//Calls made by the interpreter while redoing one that bailed out are interpreted too, as running them natively
+	//would only bail out at the same point again
+	char here;
+	if (c->bail_stack) {
+		if (vm.nframes > c->bail_frames || (vm.nframes == c->bail_frames && &here < c->bail_stack)) { return NULL; }
+		c->bail_stack = NULL;
+	}
+
+	native* n = c->native;
+	if (a->count != n->nformals) { return NULL; }
+
+	long args[a->count];
+	for (int i = 0; i < a->count; i++) {
+		if (val_type(a->cell[i]) != VAL_NUM) { return NULL; }
+		args[i] = val_number(a->cell[i]);
+	}
+
+	for (int i = 0; i < n->nguards; i++) {
+		jit_guard* g = &n->guards[i];
+		val* x = env_lookup(e, g->sym);
+		int same = 0;
+		switch (g->kind) {
+		case JIT_BUILTIN: same = val_type(x) == VAL_FUN && x->dsbuiltin == g->func; break;
+		case JIT_NUMBER: same = val_type(x) == VAL_NUM && val_number(x) == g->num; break;
+		case JIT_SELF:
+			same = val_type(x) == VAL_FUN && !x->dsbuiltin && !val_is_partial(x) && !val_is_memo(x) && x->compiled == c;
+			break;
+		}
+		val_del(x);
+		if (!same) { return NULL; }
+	}
+
+	jit_stack_limit = native_base ? native_base - native_limit : &here - 1024 * 1024;
+	jit_bail = 0;
+	long r = n->fn(args);
+	if (jit_bail) {
+		c->bail_frames = vm.nframes;
+		c->bail_stack = &here;
+		return NULL;
+	}
+
+	val_del(a);
+	return val_num(r);
+}
+
+#else
+
+void native_del(native* n, void (*release)(val*)) {}
+
+val* jit_call(env* e, val* f, val* a) { return NULL; }
+
+#endif
+
 //Read a number and return pointer to long with value
 val* val_read_num(mpc_ast_t* t) {
 	errno = 0;
 	long x = strtol(t->contents, NULL, 10);
-	return errno != ERANGE ? val_num(x) : val_err("invalid Number.");
+	return errno != ERANGE ? val_num(x) : val_err_msg("invalid Number.");
 }
 
 //Read a string and return a pointer to string with value
@@ -1426,20 +4140,55 @@ val* val_read(mpc_ast_t* t) {
 }
 
 
+//Times env_get against a growing number of globals, with the hash index and with a plain scan
+void bench_env(void) {
+	int lookups = 1000000;
+	printf("%8s %14s %14s\n", "globals", "hashed ns/get", "linear ns/get");
+
+	for (int n = 16; n <= 16384; n *= 4) {
+		env* e = env_new();
+		val* k = NULL;
+		char name[32];
+
+		//Bind n globals, looking up the one bound last, which a scan reaches last
+		for (int i = 0; i < n; i++) {
+			sprintf(name, "global%i", i);
+			val* sym = val_sym(name);
+			val* num = val_num(i);
+			env_put(e, sym, num);
+			if (i == n - 1) { k = sym; } else { val_del(sym); }
+		}
+
+		double times[2];
+		for (int pass = 0; pass < 2; pass++) {
+			//Second pass drops the index to time the scan it replaced
+			if (pass == 1) { free(e->index); e->index = NULL; }
+
+			clock_t start = clock();
+			for (int i = 0; i < lookups; i++) { val_del(env_get(e, k)); }
+			times[pass] = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / lookups;
+		}
+
+		printf("%8i %14.1f %14.1f\n", n, times[0], times[1]);
+		val_del(k);
+		env_del(e);
+	}
+}
+
 //Main repl function
 int main(int argc, char** argv)
 {
 	/*PARSING*/
 
-	//Create parsers
-	mpc_parser_t* Number = mpc_new("number");
-	mpc_parser_t* Symbol = mpc_new("symbol");
-	mpc_parser_t* String = mpc_new("string");
-	mpc_parser_t* Comment = mpc_new("comment");
-	mpc_parser_t* Sexpr = mpc_new("sexpr");
-	mpc_parser_t* Qexpr = mpc_new("qexpr");
-	mpc_parser_t* Expr = mpc_new("expr");
-	mpc_parser_t* DataScript = mpc_new("datascript");
+	//Create parsers (stored globally so builtin_load can use them)
+	Number = mpc_new("number");
+	Symbol = mpc_new("symbol");
+	String = mpc_new("string");
+	Comment = mpc_new("comment");
+	Sexpr = mpc_new("sexpr");
+	Qexpr = mpc_new("qexpr");
+	Expr = mpc_new("expr");
+	Datascript = mpc_new("datascript");
 
 	mpca_lang(MPCA_LANG_DEFAULT,
 	"                                              \
@@ -1453,47 +4202,42 @@ int main(int argc, char** argv)
               | <comment> | <sexpr>  | <qexpr>;    \
       datascript   : /^/ <expr>* /$/ ;             \
     ",
-		Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, DataScript);
+		Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Datascript);
+
+	//Intern symbols the interpreter checks for
+	sym_amp = sym_intern("&");
+	sym_if = sym_intern("if");
+	sym_select = sym_intern("select");
+	for (size_t i = 0; i < PURE_BUILTINS; i++) { pure_builtins[i].name = sym_intern(pure_builtins[i].name); }
+
+	//Allocate shared errors, kept rooted for the whole run
+	err_div_zero = val_err_msg("Division By Zero.");
+	gc_push(err_div_zero);
+
+	//Leave a quarter of the native stack for builtins and the parser
+	native_base = (char*)&argc;
+	native_limit = 1024 * 1024;
+#ifndef _WIN32
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) { native_limit = (long)rl.rlim_cur; }
+	else { native_limit = 8 * 1024 * 1024; }
+#endif
+	native_limit = native_limit / 4 * 3;
 
 	/*CONSOLE OUTPUT*/
 	//Initialise environment
 	env* e = env_new();
+	e->flags |= ENV_GLOBAL;
 	env_add_builtins(e);
-
-	//REPL (read-evaluate-print loop); Used as command line interface;
-	while (1) //LOOP
-	{
-		//READ
-		char* input = readline("> ");
-		add_history(input);
-
-		//printf("No you're a %s", input); //Echoes back user input for testing
-
-		//EVALUATE/PRINT
-		mpc_result_t r;
-		if (mpc_parse("<stdin>", input, DataScript, &r)) {
-			//On success print the Evaluation
-			//AST - DEBUG
-			//mpc_ast_print(r.output);
-			//mpc_ast_delete(r.output);
-
-			val* x = val_eval(e, val_read(r.output));
-			val_println(x);
-			val_del(x);
-			mpc_ast_delete(r.output);
-		}
-		else {
-			//Otherwise print the error
-			mpc_err_print(r.error);
-			mpc_err_delete(r.error);
-		}
-
-		free(input);
-	}
+	gc.global = e;
 
 	//Command line arguments
+	//Environment lookup benchmark
+	if (argc >= 2 && strcmp(argv[1], "--bench-env") == 0) {
+		bench_env();
+	}
 	//Supplied with list of files
-	if (argc >= 2) {
+	else if (argc >= 2) {
 		//Loop over each supplied filename (starting from 1)
 		for (int i = 1; i < argc; i++) {
 
@@ -1501,11 +4245,53 @@ int main(int argc, char** argv)
 			val* args = val_add(val_sexpr(), val_str(argv[i]));
 
 			//Pass to builtin load and get the result
+			arena_begin();
 			val* x = builtin_load(e, args);
 
 			//If the result is an error be sure to print it
-			if (x->type == VAL_ERR) { val_println(x); }
+			if (val_type(x) == VAL_ERR) { val_println(x); }
 			val_del(x);
+			arena_end();
+		}
+	}
+	//Otherwise run the repl
+	else {
+		//REPL (read-evaluate-print loop); Used as command line interface;
+		while (1) //LOOP
+		{
+			//READ
+			char* input = readline("> ");
+			add_history(input);
+
+			//printf("No you're a %s", input); //Echoes back user input for testing
+
+			//EVALUATE/PRINT
+			mpc_result_t r;
+			if (mpc_parse("<stdin>", input, Datascript, &r)) {
+				//On success print the Evaluation
+				//AST - DEBUG
+				//mpc_ast_print(r.output);
+				//mpc_ast_delete(r.output);
+
+				arena_begin();
+				val* x = val_eval(e, val_read(r.output));
+
+				//The result is rooted while it is printed
+				gc_push(x);
+				gc_maybe();
+				val_println(x);
+				gc_pop(1);
+				val_del(x);
+				arena_end();
+				mpc_ast_delete(r.output);
+			}
+			else {
+				//Otherwise print the error
+				mpc_err_print(r.error);
+				mpc_err_delete(r.error);
+			}
+
+			free(input);
 		}
 	}
 
@@ -1513,7 +4299,7 @@ int main(int argc, char** argv)
 	env_del(e);
 
 	//Undefine and delete parsers
-	mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, DataScript);
+	mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Datascript);
 
 	return 0;
 }
\ No newline at end of file